@@ -0,0 +1,57 @@
+#!/bin/bash
+#
+# Runs screenclone between two headless Xvfb servers and measures each
+# workload. Prints one JSON object per workload; compare the output of two
+# builds run on the same box.
+#
+# Usage: bench/run.sh [screenclone options...]
+#
+# Environment: SRC, DST (display names, default :91 and :92), SIZE (screen
+# size, default 1920x1080x24), DURATION (seconds per workload, default 5),
+# WORKLOADS (default "full caret scroll video cursor"), SCREENCLONE and
+# BENCH (paths to the binaries).
+
+cd "$(dirname "$0")/.."
+
+SRC=${SRC:-:91}
+DST=${DST:-:92}
+SIZE=${SIZE:-1920x1080x24}
+DURATION=${DURATION:-5}
+WORKLOADS=${WORKLOADS:-full caret scroll video cursor}
+SCREENCLONE=${SCREENCLONE:-./screenclone}
+BENCH=${BENCH:-./bench/screenclone-bench}
+LABEL="$(git describe --always --dirty 2>/dev/null) $*"
+
+pids=()
+cleanup() {
+	kill "${pids[@]}" 2>/dev/null
+	wait 2>/dev/null
+}
+trap cleanup EXIT
+
+Xvfb "$SRC" -screen 0 "$SIZE" -nolisten tcp -noreset >/dev/null 2>&1 &
+src_pid=$!
+Xvfb "$DST" -screen 0 "$SIZE" -nolisten tcp -noreset >/dev/null 2>&1 &
+dst_pid=$!
+pids+=($src_pid $dst_pid)
+
+# wait for the servers to accept connections
+for display in "$SRC" "$DST"; do
+	socket="/tmp/.X11-unix/X${display#:}"
+	for i in $(seq 50); do
+		[ -S "$socket" ] && break
+		sleep 0.1
+	done
+	[ -S "$socket" ] || { echo "Xvfb $display didn't start" >&2; exit 1; }
+done
+
+"$SCREENCLONE" -s "$SRC" -d "$DST" "$@" >/dev/null &
+clone_pid=$!
+pids+=($clone_pid)
+sleep 1
+kill -0 $clone_pid 2>/dev/null || { echo "screenclone didn't start" >&2; exit 1; }
+
+for workload in $WORKLOADS; do
+	"$BENCH" -s "$SRC" -d "$DST" -w "$workload" -t "$DURATION" -l "$LABEL" \
+		-P screenclone=$clone_pid -P xvfb_src=$src_pid -P xvfb_dst=$dst_pid
+done
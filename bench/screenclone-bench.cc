@@ -0,0 +1,383 @@
+// Drives synthetic workloads on the source X server of a running
+// screenclone and watches the destination to see when each frame arrives.
+// Prints one JSON object per run, see bench/run.sh.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#define STR2(x) #x
+#define STR(x) STR2( x )
+#define ERR throw std::runtime_error( std::string() + __FILE__ + ":" + STR( __LINE__ ) + " " + __FUNCTION__ )
+#define ERR2(msg) throw std::runtime_error( std::string() + __FILE__ + ":" + STR( __LINE__ ) + " " + __FUNCTION__  + ": " + msg)
+
+uint64_t microtime() {
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// The marker is a small square in the top left corner whose colour is the
+// number of the frame, so the destination tells us which frame it shows.
+enum { marker_size = 8 };
+
+struct source {
+	Display *dpy;
+	Window win;
+	GC gc;
+	int width, height;
+	XImage *noise;
+	std::vector< char > noise_data;
+	int scroll_line;
+
+	source( const std::string &name ) : noise( NULL ), scroll_line( 0 ) {
+		dpy = XOpenDisplay( name.c_str() );
+		if ( !dpy ) ERR2( "can't open source display " + name );
+
+		int scr = DefaultScreen( dpy );
+		width = DisplayWidth( dpy, scr );
+		height = DisplayHeight( dpy, scr );
+
+		XSetWindowAttributes attr;
+		attr.override_redirect = True;
+		attr.background_pixel = BlackPixel( dpy, scr );
+		win = XCreateWindow( dpy, RootWindow( dpy, scr ), 0, 0, width, height, 0,
+			CopyFromParent, InputOutput, CopyFromParent, CWOverrideRedirect | CWBackPixel, &attr );
+		XMapRaised( dpy, win );
+		gc = XCreateGC( dpy, win, 0, NULL );
+		XSync( dpy, False );
+	}
+
+	void marker( uint32_t frame ) {
+		XSetForeground( dpy, gc, frame & 0xffffff );
+		XFillRectangle( dpy, win, gc, 0, 0, marker_size, marker_size );
+	}
+
+	// Draws one frame of the workload.
+	void draw( const std::string &workload, uint32_t frame ) {
+		if ( workload == "full" ) {
+			XSetForeground( dpy, gc, ( frame * 0x010203 ) & 0xffffff );
+			XFillRectangle( dpy, win, gc, 0, 0, width, height );
+		} else if ( workload == "caret" ) {
+			XSetForeground( dpy, gc, frame & 1 ? WhitePixel( dpy, DefaultScreen( dpy ) ) : 0 );
+			XFillRectangle( dpy, win, gc, width / 2, height / 2, 2, 16 );
+		} else if ( workload == "scroll" ) {
+			enum { line = 16 };
+			XCopyArea( dpy, win, win, gc, 0, marker_size + line, width, height - marker_size - line, 0, marker_size );
+			XSetForeground( dpy, gc, 0 );
+			XFillRectangle( dpy, win, gc, 0, height - line, width, line );
+			XSetForeground( dpy, gc, WhitePixel( dpy, DefaultScreen( dpy ) ) );
+			std::ostringstream text;
+			text << "line " << scroll_line++ << ": the quick brown fox jumps over the lazy dog";
+			XDrawString( dpy, win, gc, 4, height - 4, text.str().c_str(), text.str().size() );
+		} else if ( workload == "video" ) {
+			int w = std::min( 640, width ), h = std::min( 360, height );
+			if ( !noise ) {
+				noise_data.resize( w * h * 4 );
+				noise = XCreateImage( dpy, DefaultVisual( dpy, DefaultScreen( dpy ) ), DefaultDepth( dpy, DefaultScreen( dpy ) ),
+					ZPixmap, 0, &noise_data[ 0 ], w, h, 32, 0 );
+				if ( !noise ) ERR;
+			}
+			uint32_t seed = frame * 2654435761u;
+			uint32_t *p = (uint32_t *) &noise_data[ 0 ];
+			for ( int i = 0; i < w * h; ++i ) {
+				seed = seed * 1664525 + 1013904223;
+				p[ i ] = seed >> 8;
+			}
+			XPutImage( dpy, win, gc, noise, 0, 0, ( width - w ) / 2, ( height - h ) / 2, w, h );
+		} else
+			ERR2( "unknown workload " + workload );
+
+		marker( frame );
+	}
+};
+
+// Reads the marker back from the destination.
+struct destination {
+	Display *dpy;
+	int x, y;
+
+	destination( const std::string &name, int _x, int _y ) : x( _x ), y( _y ) {
+		dpy = XOpenDisplay( name.c_str() );
+		if ( !dpy ) ERR2( "can't open destination display " + name );
+	}
+
+	uint32_t marker() {
+		XImage *img = XGetImage( dpy, DefaultRootWindow( dpy ), x + marker_size / 2, y + marker_size / 2, 1, 1, AllPlanes, ZPixmap );
+		if ( !img ) ERR;
+		uint32_t p = XGetPixel( img, 0, 0 ) & 0xffffff;
+		XDestroyImage( img );
+		return p;
+	}
+};
+
+// CPU time (user + system) of a process in seconds.
+double cpu_time( int pid ) {
+	char path[ 64 ];
+	snprintf( path, sizeof( path ), "/proc/%d/stat", pid );
+	FILE *f = fopen( path, "r" );
+	if ( !f )
+		return NAN;
+
+	char buf[ 1024 ];
+	size_t n = fread( buf, 1, sizeof( buf ) - 1, f );
+	fclose( f );
+	buf[ n ] = 0;
+
+	// fields after the command name, which is in parentheses
+	const char *p = strrchr( buf, ')' );
+	unsigned long utime = 0, stime = 0;
+	if ( !p || sscanf( p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime ) != 2 )
+		return NAN;
+	return (double) ( utime + stime ) / sysconf( _SC_CLK_TCK );
+}
+
+struct latencies {
+	std::vector< double > ms;
+
+	double percentile( double p ) {
+		if ( ms.empty() )
+			return NAN;
+		std::sort( ms.begin(), ms.end() );
+		return ms[ std::min( ms.size() - 1, (size_t) ( p * ms.size() ) ) ];
+	}
+
+	double average() {
+		double sum = 0;
+		for ( auto m = ms.begin(); m != ms.end(); ++m )
+			sum += *m;
+		return ms.empty() ? NAN : sum / ms.size();
+	}
+};
+
+void json_string( std::ostream &out, const std::string &s ) {
+	out << '"';
+	for ( auto c = s.begin(); c != s.end(); ++c )
+		if ( *c == '"' || *c == '\\' )
+			out << '\\' << *c;
+		else if ( (unsigned char) *c < 0x20 ) {
+			char escaped[ 8 ];
+			snprintf( escaped, sizeof( escaped ), "\\u%04x", *c );
+			out << escaped;
+		} else
+			out << *c;
+	out << '"';
+}
+
+void json_number( std::ostream &out, double v ) {
+	if ( std::isnan( v ) )
+		out << "null";
+	else
+		out << v;
+}
+
+// How long to wait between looks at the destination (us). Latencies are
+// up to that much too high, but the polling hardly shows in the CPU time
+// of the destination server.
+const useconds_t poll_interval = 500;
+
+// Draws frames as fast as the source server takes them while another
+// connection polls the destination. A frame counts as presented when its
+// marker shows up; frames that were merged with later ones never do.
+void run_frames( source &src, destination &dst, const std::string &workload, double duration,
+		uint32_t &drawn, uint32_t &seen, latencies &lat ) {
+	std::vector< uint64_t > draw_time;
+	std::mutex mutex;
+	std::atomic< bool > done( false );
+	drawn = seen = 0;
+
+	// start from a known state
+	src.draw( workload, 0 );
+	XSync( src.dpy, False );
+	uint64_t settle = microtime();
+	while ( dst.marker() != 0 && microtime() - settle < 2000000 )
+		usleep( 1000 );
+
+	std::thread reader( [&]{
+		uint32_t last = 0;
+		while ( !done ) {
+			uint32_t m = dst.marker();
+			uint64_t now = microtime();
+			if ( m == last ) {
+				// don't load the destination server with the polling
+				usleep( poll_interval );
+				continue;
+			}
+
+			std::lock_guard< std::mutex > guard( mutex );
+			if ( m > last && m < draw_time.size() ) {
+				++seen;
+				lat.ms.push_back( ( now - draw_time[ m ] ) / 1000.0 );
+			}
+			last = m;
+		}
+	} );
+
+	uint64_t start = microtime();
+	{
+		std::lock_guard< std::mutex > guard( mutex );
+		draw_time.push_back( start );
+	}
+	for ( uint32_t frame = 1; microtime() - start < duration * 1e6; ++frame ) {
+		{
+			std::lock_guard< std::mutex > guard( mutex );
+			draw_time.push_back( microtime() );
+		}
+		src.draw( workload, frame );
+		XSync( src.dpy, False );
+		drawn = frame;
+	}
+
+	// give the last frames time to arrive
+	usleep( 200000 );
+	done = true;
+	reader.join();
+}
+
+// Moves the source pointer around and waits for the destination pointer
+// to follow each time.
+void run_cursor( source &src, destination &dst, double duration, uint32_t &moves, uint32_t &seen, latencies &lat ) {
+	moves = seen = 0;
+	uint64_t start = microtime();
+	Window root = DefaultRootWindow( src.dpy );
+
+	for ( uint32_t i = 0; microtime() - start < duration * 1e6; ++i ) {
+		int x = src.width / 2 + src.width / 4 * cos( i * 0.1 );
+		int y = src.height / 2 + src.height / 4 * sin( i * 0.1 );
+		uint64_t t = microtime();
+		XWarpPointer( src.dpy, None, root, 0, 0, 0, 0, x, y );
+		XSync( src.dpy, False );
+		++moves;
+
+		while ( microtime() - t < 1000000 ) {
+			Window r, c;
+			int rx, ry, wx, wy;
+			unsigned mask;
+			XQueryPointer( dst.dpy, DefaultRootWindow( dst.dpy ), &r, &c, &rx, &ry, &wx, &wy, &mask );
+			if ( rx == dst.x + x && ry == dst.y + y ) {
+				++seen;
+				lat.ms.push_back( ( microtime() - t ) / 1000.0 );
+				break;
+			}
+			usleep( poll_interval );
+		}
+	}
+}
+
+void usage( const char *name )
+{
+	std::cerr
+		<< "Usage: " << name << " <options>" << std::endl
+		<< "Options:" << std::endl
+		<< " -s <source display name> (default :91)" << std::endl
+		<< " -d <target display name> (default :92)" << std::endl
+		<< " -w <workload: full, caret, scroll, video or cursor> (default full)" << std::endl
+		<< " -t <seconds to run> (default 5)" << std::endl
+		<< " -o <x>,<y> position of the cloned screen on the target (default 0,0)" << std::endl
+		<< " -P <name>=<pid> report the CPU time of this process (repeatable)" << std::endl
+		<< " -l <label> stored with the results, e.g. the build and options" << std::endl;
+	exit( 0 );
+}
+
+int main( int argc, char *argv[] )
+{
+	XInitThreads();
+
+	std::string src_name( ":91" ), dst_name( ":92" ), workload( "full" ), label;
+	double duration = 5;
+	int dst_x = 0, dst_y = 0;
+	std::map< std::string, int > pids;
+
+	int opt;
+	while ( ( opt = getopt( argc, argv, "s:d:w:t:o:P:l:h" ) ) != -1 )
+		switch ( opt ) {
+		case 's':
+			src_name = optarg;
+			break;
+		case 'd':
+			dst_name = optarg;
+			break;
+		case 'w':
+			workload = optarg;
+			break;
+		case 't':
+			duration = atof( optarg );
+			break;
+		case 'o':
+			if ( sscanf( optarg, "%d,%d", &dst_x, &dst_y ) != 2 )
+				usage( argv[ 0 ] );
+			break;
+		case 'P': {
+			const char *eq = strchr( optarg, '=' );
+			if ( !eq )
+				usage( argv[ 0 ] );
+			pids[ std::string( optarg, eq - optarg ) ] = atoi( eq + 1 );
+			break;
+		}
+		case 'l':
+			label = optarg;
+			break;
+		default:
+			usage( argv[ 0 ] );
+		}
+
+	source src( src_name );
+	destination dst( dst_name, dst_x, dst_y );
+
+	std::map< std::string, double > cpu_before;
+	for ( auto p = pids.begin(); p != pids.end(); ++p )
+		cpu_before[ p->first ] = cpu_time( p->second );
+
+	uint32_t drawn, seen;
+	latencies lat;
+	uint64_t start = microtime();
+	if ( workload == "cursor" )
+		run_cursor( src, dst, duration, drawn, seen, lat );
+	else
+		run_frames( src, dst, workload, duration, drawn, seen, lat );
+	double elapsed = ( microtime() - start ) / 1e6;
+
+	std::cout << "{\"label\":";
+	json_string( std::cout, label );
+	std::cout << ",\"workload\":";
+	json_string( std::cout, workload );
+	std::cout
+		<< ",\"seconds\":" << elapsed
+		<< ",\"frames_drawn\":" << drawn
+		<< ",\"frames_seen\":" << seen
+		<< ",\"fps\":" << seen / elapsed;
+	std::cout << ",\"latency_ms\":{\"avg\":";
+	json_number( std::cout, lat.average() );
+	std::cout << ",\"p50\":";
+	json_number( std::cout, lat.percentile( 0.5 ) );
+	std::cout << ",\"p95\":";
+	json_number( std::cout, lat.percentile( 0.95 ) );
+	std::cout << ",\"max\":";
+	json_number( std::cout, lat.percentile( 1 ) );
+	std::cout << "},\"cpu_seconds\":{";
+	for ( auto p = pids.begin(); p != pids.end(); ++p ) {
+		if ( p != pids.begin() )
+			std::cout << ",";
+		std::cout << "\"" << p->first << "\":";
+		json_number( std::cout, cpu_time( p->second ) - cpu_before[ p->first ] );
+	}
+	std::cout << "}}" << std::endl;
+}
@@ -0,0 +1,359 @@
+// Shows the screen sent by screenclone -n on a display of its own, with
+// the pointer and cursor of the source, or replays a recording made with
+// screenclone -o. See stream_protocol.h.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <X11/Xcursor/Xcursor.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include "stream_protocol.h"
+
+#define STR2(x) #x
+#define STR(x) STR2( x )
+#define ERR throw std::runtime_error( std::string() + __FILE__ + ":" + STR( __LINE__ ) + " " + __FUNCTION__ )
+#define ERR2(msg) throw std::runtime_error( std::string() + __FILE__ + ":" + STR( __LINE__ ) + " " + __FUNCTION__  + ": " + msg)
+
+uint64_t microtime() {
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// Reads exactly length bytes, false at the end of the stream.
+bool read_all( int fd, void *data, size_t length ) {
+	char *p = (char *) data;
+	while ( length ) {
+		ssize_t n = read( fd, p, length );
+		if ( n < 0 && errno == EINTR )
+			continue;
+		if ( n <= 0 )
+			return false;
+		p += n;
+		length -= n;
+	}
+	return true;
+}
+
+struct receiver {
+	Display *dpy;
+	Window root;
+	GC gc;
+	int x_org, y_org;	// where the screen goes
+	XShmSegmentInfo info;
+	XImage *image;
+	Cursor invisible, current;
+	std::map< uint32_t, Cursor > cursors;
+	bool visible;
+	uint64_t frames;
+
+	receiver( const std::string &name, int _x_org, int _y_org )
+		: x_org( _x_org ), y_org( _y_org ), image( NULL ), current( None ), visible( false ), frames( 0 )
+	{
+		dpy = XOpenDisplay( name.c_str() );
+		if ( !dpy ) ERR2( "can't open display " + name );
+		if ( !XShmQueryExtension( dpy ) ) ERR2( "no MIT-SHM on " + name );
+
+		root = DefaultRootWindow( dpy );
+		gc = XCreateGC( dpy, root, 0, NULL );
+
+		Pixmap empty;
+		XColor black;
+		static char no_data[] = { 0,0,0,0,0,0,0,0 };
+		black.red = black.green = black.blue = 0;
+		empty = XCreateBitmapFromData( dpy, root, no_data, 8, 8 );
+		invisible = XCreatePixmapCursor( dpy, empty, empty, &black, &black, 0, 0 );
+		XFreePixmap( dpy, empty );
+	}
+
+	void hello( const stream_hello &h ) {
+		if ( h.magic != stream_magic || h.version != stream_version )
+			ERR2( "not a screenclone stream, or a different version" );
+
+		// serials of another sender mean other cursors
+		for ( auto c = cursors.begin(); c != cursors.end(); ++c )
+			XFreeCursor( dpy, c->second );
+		cursors.clear();
+		current = None;
+		visible = false;
+		XDefineCursor( dpy, root, invisible );
+
+		if ( image && image->width == h.width && image->height == h.height ) {
+			// a new sender starts from black again
+			memset( image->data, 0, image->bytes_per_line * image->height );
+			return;
+		}
+		if ( image ) {
+			XShmDetach( dpy, &info );
+			XSync( dpy, False );
+			shmdt( info.shmaddr );
+			// XDestroyImage would free both
+			image->data = image->obdata = NULL;
+			XDestroyImage( image );
+		}
+
+		image = XShmCreateImage( dpy, DefaultVisual( dpy, DefaultScreen( dpy ) ),
+			DefaultDepth( dpy, DefaultScreen( dpy ) ), ZPixmap, NULL, &info, h.width, h.height );
+		if ( !image ) ERR;
+		if ( image->bits_per_pixel != 32 || image->red_mask != 0xff0000
+				|| image->green_mask != 0xff00 || image->blue_mask != 0xff )
+			ERR2( "the display isn't 32 bit xRGB" );
+
+		info.shmid = shmget( IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600 );
+		if ( info.shmid < 0 ) ERR;
+		info.shmaddr = image->data = (char *) shmat( info.shmid, 0, 0 );
+		info.readOnly = True;
+		shmctl( info.shmid, IPC_RMID, NULL );
+		// the stream starts from black, like the previous frame of the sender
+		memset( image->data, 0, image->bytes_per_line * image->height );
+		if ( !XShmAttach( dpy, &info ) ) ERR;
+	}
+
+	void tile( const uint32_t *payload, size_t words ) {
+		const stream_tile &t = * (const stream_tile *) payload;
+		if ( !image || t.x + t.width > image->width || t.y + t.height > image->height )
+			ERR2( "tile outside the screen" );
+
+		size_t header = sizeof( t ) / sizeof( uint32_t );
+		char *dst = image->data + t.y * image->bytes_per_line + t.x * 4;
+		if ( !stream_decode( payload + header, words - header, dst, image->bytes_per_line, t.width, t.height ) )
+			ERR2( "broken tile" );
+
+		XShmPutImage( dpy, root, gc, image, t.x, t.y, x_org + t.x, y_org + t.y, t.width, t.height, False );
+	}
+
+	void frame_end() {
+		// the next tiles write into the image, the server must be done with it
+		XSync( dpy, False );
+	}
+
+	void pointer( const stream_pointer &p ) {
+		if ( p.visible )
+			XWarpPointer( dpy, None, root, 0, 0, 0, 0, x_org + p.x, y_org + p.y );
+		if ( p.visible != visible ) {
+			visible = p.visible;
+			XDefineCursor( dpy, root, visible && current ? current : invisible );
+		}
+		XFlush( dpy );
+	}
+
+	void cursor( const uint32_t *payload, size_t words ) {
+		const stream_cursor &c = * (const stream_cursor *) payload;
+		size_t header = sizeof( c ) / sizeof( uint32_t );
+
+		// pixels come with a cursor the first time, they win over what is
+		// cached
+		auto known = cursors.find( c.serial );
+		if ( known != cursors.end() && !( c.width && c.height ) )
+			current = known->second;
+		else {
+			if ( !( c.width && c.height ) || words - header < (size_t) c.width * c.height )
+				ERR2( "broken cursor" );
+			if ( known != cursors.end() )
+				XFreeCursor( dpy, known->second );
+
+			XcursorImage img;
+			memset( &img, 0, sizeof( img ) );
+			img.width = c.width;
+			img.height = c.height;
+			img.size = std::max( c.width, c.height );
+			img.xhot = c.xhot;
+			img.yhot = c.yhot;
+			img.pixels = (XcursorPixel *) ( payload + header );
+			current = cursors[ c.serial ] = XcursorImageLoadCursor( dpy, &img );
+		}
+
+		if ( visible )
+			XDefineCursor( dpy, root, current );
+		XFlush( dpy );
+	}
+
+	// Applies one message; payload is aligned to 32 bits.
+	void message( const stream_header &header, const uint32_t *payload ) {
+		if ( header.length % sizeof( uint32_t ) )
+			ERR2( "broken message" );
+		size_t words = header.length / sizeof( uint32_t );
+
+		switch ( header.type ) {
+		case stream_msg_hello:
+			if ( header.length < sizeof( stream_hello ) ) ERR2( "broken hello" );
+			hello( * (const stream_hello *) payload );
+			break;
+		case stream_msg_tile:
+			if ( header.length < sizeof( stream_tile ) ) ERR2( "broken tile" );
+			tile( payload, words );
+			break;
+		case stream_msg_frame_end:
+			frame_end();
+			++frames;
+			break;
+		case stream_msg_pointer:
+			if ( header.length < sizeof( stream_pointer ) ) ERR2( "broken pointer" );
+			pointer( * (const stream_pointer *) payload );
+			break;
+		case stream_msg_cursor:
+			if ( header.length < sizeof( stream_cursor ) ) ERR2( "broken cursor" );
+			cursor( payload, words );
+			break;
+		default:
+			// newer messages we don't know, skip them
+			break;
+		}
+	}
+
+	// Longer messages are broken: the most is a tile of the whole screen
+	// that changed everywhere, or a big cursor.
+	size_t max_length() const {
+		size_t screen = image ? (size_t) image->width * image->height : 0;
+		return std::max( sizeof( stream_tile ) + 2 * screen * sizeof( uint32_t ),
+			sizeof( stream_cursor ) + 512 * 512 * sizeof( uint32_t ) );
+	}
+
+	// Applies one connection's stream, until it ends.
+	void run( int fd ) {
+		std::vector< uint32_t > payload;
+		stream_header header;
+		while ( read_all( fd, &header, sizeof( header ) ) ) {
+			if ( header.length > max_length() )
+				ERR2( "message too long" );
+			payload.resize( header.length / sizeof( uint32_t ) + 1 );
+			if ( !read_all( fd, &payload[ 0 ], header.length ) )
+				break;
+			message( header, &payload[ 0 ] );
+		}
+	}
+
+	// Applies a recording as fast as possible, or at the pace it was
+	// recorded at.
+	void replay( const char *data, size_t size, bool timed ) {
+		uint64_t start = microtime();
+		size_t offset = 0;
+		while ( offset + sizeof( stream_chunk ) <= size ) {
+			const stream_chunk &chunk = * (const stream_chunk *) ( data + offset );
+			offset += sizeof( chunk );
+			if ( chunk.magic != stream_chunk_magic || chunk.length > size - offset )
+				ERR2( "broken recording" );
+
+			if ( timed ) {
+				uint64_t now = microtime();
+				if ( start + chunk.time > now )
+					usleep( start + chunk.time - now );
+			}
+
+			const char *p = data + offset, *end = p + chunk.length;
+			while ( end - p >= (ptrdiff_t) sizeof( stream_header ) ) {
+				const stream_header &header = * (const stream_header *) p;
+				p += sizeof( header );
+				if ( header.length > (size_t) ( end - p ) )
+					ERR2( "broken recording" );
+				message( header, (const uint32_t *) p );
+				p += header.length;
+			}
+			offset += chunk.length;
+		}
+	}
+};
+
+void usage( const char *name )
+{
+	std::cerr
+		<< "Usage: " << name << " <options>" << std::endl
+		<< "Options:" << std::endl
+		<< " -d <display name> (default :0)" << std::endl
+		<< " -l <host:port or socket path> where to wait for screenclone -n" << std::endl
+		<< " -o <x>,<y> where to put the screen on the display (default 0,0)" << std::endl
+		<< " -r <file> replay a recording of screenclone -o as fast as possible and print how long it took" << std::endl
+		<< "    (this measures the receiver; screenclone -i plays it through screenclone's copy path)" << std::endl
+		<< " -t replay at the recorded pace" << std::endl;
+	exit( 0 );
+}
+
+int main( int argc, char *argv[] )
+{
+	std::string dpy_name( ":0" ), address, recording;
+	int x_org = 0, y_org = 0;
+	bool timed = false;
+
+	int opt;
+	while ( ( opt = getopt( argc, argv, "d:l:o:r:th" ) ) != -1 )
+		switch ( opt ) {
+		case 'd':
+			dpy_name = optarg;
+			break;
+		case 'l':
+			address = optarg;
+			break;
+		case 'o':
+			if ( sscanf( optarg, "%d,%d", &x_org, &y_org ) != 2 )
+				usage( argv[ 0 ] );
+			break;
+		case 'r':
+			recording = optarg;
+			break;
+		case 't':
+			timed = true;
+			break;
+		default:
+			usage( argv[ 0 ] );
+		}
+
+	if ( address.empty() == recording.empty() )
+		usage( argv[ 0 ] );
+
+	receiver r( dpy_name, x_org, y_org );
+
+	if ( !recording.empty() ) {
+		int fd = open( recording.c_str(), O_RDONLY | O_CLOEXEC );
+		struct stat st;
+		if ( fd < 0 || fstat( fd, &st ) )
+			ERR2( "can't open " + recording + ": " + strerror( errno ) );
+		void *data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if ( data == MAP_FAILED ) ERR;
+		madvise( data, st.st_size, MADV_SEQUENTIAL );
+
+		uint64_t start = microtime();
+		r.replay( (const char *) data, st.st_size, timed );
+		double seconds = ( microtime() - start ) / 1e6;
+		printf( "{\"recording\": \"%s\", \"frames\": %llu, \"seconds\": %.3f, \"fps\": %.1f}\n",
+			recording.c_str(), (unsigned long long) r.frames, seconds, r.frames / seconds );
+		return 0;
+	}
+	int listener = stream_socket( address, true );
+
+	// one sender at a time, the next one may come after it's gone
+	for ( ;; ) {
+		int fd = accept4( listener, NULL, NULL, SOCK_CLOEXEC );
+		if ( fd < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			ERR2( strerror( errno ) );
+		}
+
+		try {
+			r.run( fd );
+		} catch ( const std::exception &e ) {
+			std::cerr << "WARN: " << e.what() << std::endl;
+		}
+		close( fd );
+	}
+}
@@ -1,36 +1,63 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <exception>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <poll.h>
 #include <sys/ipc.h>
+#include <sys/mman.h>
 #include <sys/shm.h>
-#include <sys/select.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#	include <immintrin.h>
+#endif
+
 #include <X11/Xcursor/Xcursor.h>
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
 #include <X11/Xproto.h>
 #include <X11/cursorfont.h>
 #include <X11/extensions/XShm.h>
+#include <X11/extensions/Xcomposite.h>
 #include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xinerama.h>
 #include <X11/extensions/record.h>
 #include <X11/extensions/Xrandr.h>
 
+#include "stream_protocol.h"
+
 //#define ENABLE_NVCTRL
 
 #ifdef ENABLE_NVCTRL
 #	include <NVCtrl/NVCtrlLib.h>
 #endif	// ENABLE_NVCTRL
 
+#ifdef ENABLE_XCB
+#	include <X11/Xlib-xcb.h>
+#	include <xcb/shm.h>
+#endif	// ENABLE_XCB
+
 #define STR2(x) #x
 #define STR(x) STR2( x )
 #define ERR throw std::runtime_error( std::string() + __FILE__ + ":" + STR( __LINE__ ) + " " + __FUNCTION__ )
@@ -56,22 +83,147 @@ uint64_t microtime() {
 	printf( "%15llu - %5d: %s\n", t2 - t1, __LINE__, #x ); ret; })
 #endif
 
+// Latency histogram, safe to update from any thread. Bucket bounds are in
+// microseconds, the last bucket is everything above.
+struct histogram {
+	enum { buckets = 12 };
+
+	std::atomic< uint64_t > counts[ buckets ];
+	std::atomic< uint64_t > sum;
+
+	histogram() : sum( 0 ) {
+		for ( int i = 0; i < buckets; ++i )
+			counts[ i ] = 0;
+	}
+
+	static uint64_t bound( int i ) {
+		static const uint64_t bounds[ buckets - 1 ] =
+			{ 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000 };
+		return bounds[ i ];
+	}
+
+	void add( uint64_t us ) {
+		int i = 0;
+		while ( i < buckets - 1 && us > bound( i ) )
+			++i;
+		counts[ i ].fetch_add( 1, std::memory_order_relaxed );
+		sum.fetch_add( us, std::memory_order_relaxed );
+	}
+
+	// Prometheus style: cumulative buckets, sum and count, in seconds.
+	void write( std::ostream &out, const char *name ) const {
+		uint64_t total = 0;
+		for ( int i = 0; i < buckets; ++i ) {
+			total += counts[ i ].load( std::memory_order_relaxed );
+			out << name << "_bucket{le=\"";
+			if ( i < buckets - 1 )
+				out << bound( i ) / 1e6;
+			else
+				out << "+Inf";
+			out << "\"} " << total << "\n";
+		}
+		out << name << "_sum " << sum.load( std::memory_order_relaxed ) / 1e6 << "\n";
+		out << name << "_count " << total << "\n";
+	}
+};
+
+// Everything the stats file reports.
+struct metrics {
+	std::atomic< uint64_t > damage_events, frames, bytes_captured, bytes_uploaded, cursor_changes;
+	std::atomic< uint64_t > motion_events, warps, cursor_uploads, dropped_frames;
+	std::atomic< uint64_t > shm_reserved, shm_used, shm_huge, exposures;
+	histogram get_image, put_image, flush, damage_to_present, cursor_warp, fetch_damage;
+
+	metrics()
+		: damage_events( 0 ), frames( 0 ), bytes_captured( 0 ), bytes_uploaded( 0 ), cursor_changes( 0 )
+		, motion_events( 0 ), warps( 0 ), cursor_uploads( 0 ), dropped_frames( 0 )
+		, shm_reserved( 0 ), shm_used( 0 ), shm_huge( 0 ), exposures( 0 ) {}
+
+	void write( std::ostream &out, double uptime, double interval, uint64_t last_damage_events, uint64_t last_frames ) const {
+		out << "screenclone_uptime_seconds " << uptime << "\n"
+			<< "screenclone_damage_events_total " << damage_events << "\n"
+			<< "screenclone_damage_events_per_second " << ( damage_events - last_damage_events ) / interval << "\n"
+			<< "screenclone_frames_total " << frames << "\n"
+			<< "screenclone_frames_per_second " << ( frames - last_frames ) / interval << "\n"
+			<< "screenclone_bytes_captured_total " << bytes_captured << "\n"
+			<< "screenclone_bytes_uploaded_total " << bytes_uploaded << "\n"
+			<< "screenclone_cursor_changes_total " << cursor_changes << "\n"
+			<< "screenclone_motion_events_total " << motion_events << "\n"
+			<< "screenclone_warps_total " << warps << "\n"
+			<< "screenclone_cursor_uploads_total " << cursor_uploads << "\n"
+			<< "screenclone_dropped_frames_total " << dropped_frames << "\n"
+			<< "screenclone_shm_reserved_bytes " << shm_reserved << "\n"
+			<< "screenclone_shm_used_bytes " << shm_used << "\n"
+			<< "screenclone_shm_huge_page_bytes " << shm_huge << "\n"
+			<< "screenclone_exposures_total " << exposures << "\n";
+		get_image.write( out, "screenclone_get_image_seconds" );
+		put_image.write( out, "screenclone_put_image_seconds" );
+		flush.write( out, "screenclone_flush_seconds" );
+		damage_to_present.write( out, "screenclone_damage_to_present_seconds" );
+		cursor_warp.write( out, "screenclone_cursor_warp_seconds" );
+		fetch_damage.write( out, "screenclone_fetch_damage_seconds" );
+	}
+};
+
+metrics stats;
+
+// like TC, and adds the time to a histogram of stats
+#define TM(h, x) \
+	({ uint64_t t1_ = microtime(); auto ret_ = TC( x ); stats.h.add( microtime() - t1_ ); ret_; })
+
+// Rewrites the stats file every second. Writes a temporary file and
+// renames it, so readers never see half of it.
+void stats_thread( std::string path ) {
+	uint64_t start = microtime(), last = start;
+	uint64_t last_damage_events = 0, last_frames = 0;
+	std::string tmp = path + ".tmp";
+
+	for ( ;; ) {
+		std::this_thread::sleep_for( std::chrono::seconds( 1 ) );
+
+		uint64_t now = microtime();
+		{
+			std::ofstream out( tmp.c_str() );
+			stats.write( out, ( now - start ) / 1e6, ( now - last ) / 1e6, last_damage_events, last_frames );
+		}
+		if ( rename( tmp.c_str(), path.c_str() ) )
+			std::cerr << "WARN: couldn't write " << path << std::endl;
+
+		last = now;
+		last_damage_events = stats.damage_events;
+		last_frames = stats.frames;
+	}
+}
+
+// Set by io_error when a connection to the destination breaks; main then
+// connects again. Until then, the calls on the broken connections return
+// at once and wait_event gives up.
+std::atomic< bool > dst_lost( false );
+
 struct window;
 struct xinerama_screen;
 
 struct display {
 	Display *dpy;
+#ifdef ENABLE_XCB
+	xcb_connection_t *conn;	// the same connection, for requests that shouldn't block
+#endif
 	int damage_event, damage_error;
 	int xfixes_event, xfixes_error;
+	int randr_event, randr_error;	// -1 without RandR
 
 	display( const std::string &name );
 	display clone() const;
 	window root() const;
 	XEvent next_event();
+	bool wait_event( XEvent &e ) const;
 	int pending();
+	bool queued();
 
-	template < typename Fun > void record_pointer_events( Fun *callback );
+	template < typename Fun > display record_pointer_events( Fun *callback );
 	void select_cursor_input( const window &win );
+	void select_screen_changes();
+	bool screen_changed( XEvent &e );
 
 	typedef std::vector< xinerama_screen > screens_vector;
 	screens_vector xinerama_screens();
@@ -81,10 +233,12 @@ struct window {
 	const display *d;
 	Window win;
 	Damage dmg;
+	XserverRegion parts;	// damage fetched from the server, if accumulated there
 
-	window( const display &_d, Window _win ) : d( &_d ), win( _win ), dmg( 0 ) {}
-	void create_damage();
+	window( const display &_d, Window _win ) : d( &_d ), win( _win ), dmg( 0 ), parts( None ) {}
+	void create_damage( bool accumulate );
 	void clear_damage();
+	void fetch_damage( std::vector< XRectangle > &rects );
 	void warp_pointer( int x, int y );
 	void define_cursor( Cursor c );
 };
@@ -100,14 +254,24 @@ struct xinerama_screen {
 	bool intersect_rectangle( const XRectangle &rec ) const;
 };
 
+// Called after io_error returns, instead of exiting. The connection is
+// dead from then on, its calls do nothing until it's closed.
+void io_error_exit( Display *, void * ) {}
+
 display::display( const std::string &name ) {
 	dpy = XOpenDisplay( name.c_str() );
 	if ( !dpy ) ERR;
+	XSetIOErrorExitHandler( dpy, &io_error_exit, NULL );
+#ifdef ENABLE_XCB
+	conn = XGetXCBConnection( dpy );
+#endif
 
 	if ( !XDamageQueryExtension( dpy, &damage_event, &damage_error ) )
 		ERR;
 	if ( !XFixesQueryExtension( dpy, &xfixes_event, &xfixes_error ) )
 		ERR;
+	if ( !XRRQueryExtension( dpy, &randr_event, &randr_error ) )
+		randr_event = randr_error = -1;
 }
 
 display display::clone() const {
@@ -124,31 +288,39 @@ XEvent display::next_event() {
 	return e;
 }
 
+// Like next_event, for the other threads: gives up and returns false once
+// the destination is lost, which a blocking XNextEvent wouldn't notice.
+bool display::wait_event( XEvent &e ) const {
+	while ( !XPending( dpy ) ) {
+		if ( dst_lost )
+			return false;
+		struct pollfd p = { ConnectionNumber( dpy ), POLLIN, 0 };
+		poll( &p, 1, 100 );
+	}
+	XNextEvent( dpy, &e );
+	return true;
+}
+
 int display::pending() {
 	return XPending( dpy );
 }
 
+// Whether events are already read and waiting in Xlib's queue, where
+// polling the connection won't see them.
+bool display::queued() {
+	return XEventsQueued( dpy, QueuedAlready ) > 0;
+}
+
 template < typename Fun >
 void record_callback( XPointer priv, XRecordInterceptData *data ) {
 	Fun *f = (Fun *) priv;
 	(*f)( data );
 }
 
+// Returns the connection the events come in on; call
+// XRecordProcessReplies on it when it's readable.
 template < typename Fun >
-void record_thread( display data, Fun *callback ) {
-	int fd = ConnectionNumber( data.dpy );
-	fd_set fds;
-	FD_ZERO( &fds );
-
-	for ( ;; ) {
-		FD_SET( fd, &fds );
-		select( fd + 1, &fds, NULL, NULL, NULL );
-		XRecordProcessReplies( data.dpy );
-	}
-}
-
-template < typename Fun >
-void display::record_pointer_events( Fun *callback ) {
+display display::record_pointer_events( Fun *callback ) {
 	display data = clone();
 
 	XRecordRange *rr = XRecordAllocRange();
@@ -167,13 +339,30 @@ void display::record_pointer_events( Fun *callback ) {
 	if ( !XRecordEnableContextAsync( data.dpy, rc, &record_callback< Fun >, (XPointer) callback ) )
 		ERR;
 
-	std::thread( &record_thread< Fun >, data, callback ).detach();
+	return data;
 }
 
 void display::select_cursor_input( const window &win ) {
 	XFixesSelectCursorInput( dpy, win.win, XFixesDisplayCursorNotifyMask );
 }
 
+void display::select_screen_changes() {
+	if ( randr_event >= 0 )
+		XRRSelectInput( dpy, DefaultRootWindow( dpy ), RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask );
+}
+
+// Whether e says that the screen layout changed. Also keeps Xlib's idea
+// of the screen size up to date.
+bool display::screen_changed( XEvent &e ) {
+	if ( randr_event < 0 )
+		return false;
+	if ( e.type == randr_event + RRScreenChangeNotify ) {
+		XRRUpdateConfiguration( &e );
+		return true;
+	}
+	return e.type == randr_event + RRNotify;
+}
+
 display::screens_vector display::xinerama_screens() {
 	int number;
 	XineramaScreenInfo *screens = XineramaQueryScreens( dpy, &number );
@@ -187,8 +376,13 @@ display::screens_vector display::xinerama_screens() {
 	return vec;
 }
 
-void window::create_damage() {
-	if ( !( dmg = XDamageCreate( d->dpy, win, XDamageReportRawRectangles ) ) )
+// Either every damaged rectangle comes as an event, or the server
+// accumulates them and only reports that there is damage; it's then
+// collected with fetch_damage.
+void window::create_damage( bool accumulate ) {
+	if ( !( dmg = XDamageCreate( d->dpy, win, accumulate ? XDamageReportNonEmpty : XDamageReportRawRectangles ) ) )
+		ERR;
+	if ( accumulate && !( parts = XFixesCreateRegion( d->dpy, NULL, 0 ) ) )
 		ERR;
 }
 
@@ -198,96 +392,2582 @@ void window::clear_damage() {
 	XDamageSubtract( d->dpy, dmg, None, None );
 }
 
-void window::warp_pointer( int x, int y ) {
-	TC( XWarpPointer( d->dpy, None, win, 0, 0, 0, 0, x, y ) );
-}
+// Takes the accumulated damage, all of it in one reply.
+void window::fetch_damage( std::vector< XRectangle > &rects ) {
+	if ( !dmg || !parts ) ERR;
+
+	XDamageSubtract( d->dpy, dmg, None, parts );
+	int count;
+	XRectangle *r = TM( fetch_damage, XFixesFetchRegion( d->dpy, parts, &count ) );
+	rects.assign( r, r + count );
+	if ( r )
+		XFree( r );
+}
+
+void window::warp_pointer( int x, int y ) {
+	TC( XWarpPointer( d->dpy, None, win, 0, 0, 0, 0, x, y ) );
+}
+
+void window::define_cursor( Cursor c ) {
+	TC( XDefineCursor( d->dpy, win, c ) );
+}
+
+bool xinerama_screen::in_screen( int x, int y ) const {
+	return x >= info.x_org && x < info.x_org + info.width
+		&& y >= info.y_org && y < info.y_org + info.height;
+}
+
+bool segment_intersect( int a1, int a2, int b1, int b2 ) {
+	return a1 < b1 ? a2 > b1 : b2 > a1;
+}
+
+bool xinerama_screen::intersect_rectangle( const XRectangle &rec ) const {
+	return segment_intersect( rec.x, rec.x + rec.width,  info.x_org, info.x_org + info.width  )
+		&& segment_intersect( rec.y, rec.y + rec.height, info.y_org, info.y_org + info.height );
+}
+
+// Event loop over file descriptors, mostly X connections; timed work is
+// up to the caller, through the deadline of run_once. Xlib may read
+// events into its queue while doing something else, so each connection
+// can also say it has work without its socket being readable.
+struct reactor {
+	struct watch {
+		std::function< void() > handler;
+		std::function< bool() > queued;
+	};
+
+	int epfd;
+	std::map< int, watch > watches;
+
+	reactor() {
+		epfd = epoll_create1( EPOLL_CLOEXEC );
+		if ( epfd < 0 ) ERR;
+	}
+
+	void add( int fd, const std::function< void() > &handler, const std::function< bool() > &queued = std::function< bool() >() ) {
+		struct epoll_event ev;
+		memset( &ev, 0, sizeof( ev ) );
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if ( epoll_ctl( epfd, EPOLL_CTL_ADD, fd, &ev ) ) ERR;
+
+		watch w = { handler, queued };
+		watches[ fd ] = w;
+	}
+
+	void add_display( display &d, const std::function< void() > &handler ) {
+		add( ConnectionNumber( d.dpy ), handler, [&d]{ return d.queued(); } );
+	}
+
+	// Stops watching fd, before it's closed.
+	void remove( int fd ) {
+		epoll_ctl( epfd, EPOLL_CTL_DEL, fd, NULL );
+		watches.erase( fd );
+	}
+
+	// Waits for something to do until deadline (microtime, 0 for no
+	// deadline) and does it.
+	void run_once( uint64_t deadline ) {
+		int timeout = -1;
+		for ( auto w = watches.begin(); w != watches.end(); ++w )
+			if ( w->second.queued && w->second.queued() )
+				timeout = 0;
+
+		if ( timeout && deadline ) {
+			uint64_t now = microtime();
+			timeout = deadline > now ? ( deadline - now + 999 ) / 1000 : 0;
+		}
+
+		enum { max_events = 8 };
+		struct epoll_event events[ max_events ];
+		int n = epoll_wait( epfd, events, max_events, timeout );
+		if ( n < 0 && errno != EINTR ) ERR;
+
+		std::set< int > ready;
+		for ( int i = 0; i < n; ++i )
+			ready.insert( events[ i ].data.fd );
+		for ( auto w = watches.begin(); w != watches.end(); ++w )
+			if ( w->second.queued && w->second.queued() )
+				ready.insert( w->first );
+
+		for ( auto fd = ready.begin(); fd != ready.end(); ++fd )
+			watches[ *fd ].handler();
+	}
+};
+
+int rect_area( const XRectangle &r ) {
+	return r.width * r.height;
+}
+
+XRectangle rect_union( const XRectangle &a, const XRectangle &b ) {
+	int x1 = std::min( a.x, b.x ), y1 = std::min( a.y, b.y );
+	int x2 = std::max( a.x + a.width, b.x + b.width );
+	int y2 = std::max( a.y + a.height, b.y + b.height );
+	XRectangle r = { (short) x1, (short) y1, (unsigned short) ( x2 - x1 ), (unsigned short) ( y2 - y1 ) };
+	return r;
+}
+
+bool rect_overlap( const XRectangle &a, const XRectangle &b ) {
+	return segment_intersect( a.x, a.x + a.width,  b.x, b.x + b.width  )
+		&& segment_intersect( a.y, a.y + a.height, b.y, b.y + b.height );
+}
+
+// Set of damaged rectangles relative to a screen of the given size. Raw
+// rectangles are clipped on insertion and merged into a few disjoint
+// rectangles; if they cover most of the screen, we just copy all of it.
+struct damage_region {
+	enum {
+		max_raw = 64,			// merge once this many raw rectangles pile up
+		max_rects = 16,			// at most this many rectangles per copy
+		merge_slack = 64 * 64,	// merge if the union wastes at most that many pixels
+	};
+
+	int width, height;
+	std::vector< XRectangle > rects;
+	bool full;
+	uint64_t since;		// time of the first damage, 0 if unknown
+
+	damage_region( int _width, int _height )
+		: width( _width ), height( _height ), full( true ), since( 0 ) {}
+
+	bool empty() const {
+		return !full && rects.empty();
+	}
+
+	void clear() {
+		rects.clear();
+		full = false;
+		since = 0;
+	}
+
+	void add( const damage_region &other ) {
+		if ( other.since && ( !since || other.since < since ) )
+			since = other.since;
+		if ( other.full )
+			full = true;
+		if ( full )
+			return;
+
+		for ( auto r = other.rects.begin(); r != other.rects.end(); ++r )
+			add( r->x, r->y, r->width, r->height );
+	}
+
+	// rec is relative to the origin of the screen, when is the time of the
+	// damage if it isn't now
+	void add( int x, int y, int w, int h, uint64_t when = 0 ) {
+		if ( full )
+			return;
+
+		int x1 = std::max( x, 0 ), y1 = std::max( y, 0 );
+		int x2 = std::min( x + w, width ), y2 = std::min( y + h, height );
+		if ( x1 >= x2 || y1 >= y2 )
+			return;
+
+		XRectangle r = { (short) x1, (short) y1, (unsigned short) ( x2 - x1 ), (unsigned short) ( y2 - y1 ) };
+		rects.push_back( r );
+		if ( !when )
+			when = microtime();
+		if ( !since || when < since )
+			since = when;
+
+		if ( rects.size() > max_raw )
+			merge();
+	}
+
+	// rec is in root window coordinates, this region is of screen
+	void add( const XRectangle &rec, const xinerama_screen &screen, uint64_t when = 0 ) {
+		add( rec.x - screen.info.x_org, rec.y - screen.info.y_org, rec.width, rec.height, when );
+	}
+
+	// The rectangles to copy, the whole screen if full.
+	std::vector< XRectangle > list() const {
+		if ( !full )
+			return rects;
+		XRectangle r = { 0, 0, (unsigned short) width, (unsigned short) height };
+		return std::vector< XRectangle >( 1, r );
+	}
+
+	void merge() {
+		if ( full )
+			return;
+
+		// Merge overlapping and nearby rectangles until nothing changes.
+		// Overlapping ones are always merged, so the result is disjoint.
+		bool changed = true;
+		while ( changed ) {
+			changed = false;
+			for ( size_t i = 0; i < rects.size(); ++i )
+				for ( size_t j = i + 1; j < rects.size(); ) {
+					if ( rect_overlap( rects[ i ], rects[ j ] ) || waste( rects[ i ], rects[ j ] ) <= merge_slack ) {
+						rects[ i ] = rect_union( rects[ i ], rects[ j ] );
+						rects[ j ] = rects.back();
+						rects.pop_back();
+						changed = true;
+					} else
+						++j;
+				}
+		}
+
+		// Too many left, merge the pairs that waste the least.
+		while ( rects.size() > max_rects ) {
+			size_t bi = 0, bj = 1;
+			int best = -1;
+			for ( size_t i = 0; i < rects.size(); ++i )
+				for ( size_t j = i + 1; j < rects.size(); ++j ) {
+					int w = waste( rects[ i ], rects[ j ] );
+					if ( best < 0 || w < best ) {
+						best = w;
+						bi = i;
+						bj = j;
+					}
+				}
+
+			rects[ bi ] = rect_union( rects[ bi ], rects[ bj ] );
+			rects[ bj ] = rects.back();
+			rects.pop_back();
+
+			// the union might overlap others now
+			merge();
+			if ( full )
+				return;
+		}
+
+		// Close to the whole screen, one big copy is cheaper.
+		if ( (int64_t) area() * 4 >= (int64_t) width * height * 3 )
+			full = true;
+	}
+
+	int area() const {
+		int a = 0;
+		for ( auto r = rects.begin(); r != rects.end(); ++r )
+			a += rect_area( *r );
+		return a;
+	}
+
+	static int waste( const XRectangle &a, const XRectangle &b ) {
+		return rect_area( rect_union( a, b ) ) - rect_area( a ) - rect_area( b );
+	}
+};
+
+// An XImage of the given size over a part of another image's SHM segment.
+XImage sub_image( const XImage *img, char *data, int width, int height ) {
+	XImage sub = *img;
+	sub.width = width;
+	sub.height = height;
+	sub.bytes_per_line = ( ( width * img->bits_per_pixel + img->bitmap_pad - 1 ) / img->bitmap_pad ) * img->bitmap_pad / 8;
+	sub.data = data;
+	return sub;
+}
+
+// Like memcmp( a, b, n ) == 0, but 64 bytes at a time.
+bool mem_equal( const char *a, const char *b, size_t n ) {
+#ifdef __SSE2__
+	for ( ; n >= 64; a += 64, b += 64, n -= 64 ) {
+		__m128i x0 = _mm_xor_si128( _mm_loadu_si128( (const __m128i *) a ),        _mm_loadu_si128( (const __m128i *) b ) );
+		__m128i x1 = _mm_xor_si128( _mm_loadu_si128( (const __m128i *) ( a + 16 ) ), _mm_loadu_si128( (const __m128i *) ( b + 16 ) ) );
+		__m128i x2 = _mm_xor_si128( _mm_loadu_si128( (const __m128i *) ( a + 32 ) ), _mm_loadu_si128( (const __m128i *) ( b + 32 ) ) );
+		__m128i x3 = _mm_xor_si128( _mm_loadu_si128( (const __m128i *) ( a + 48 ) ), _mm_loadu_si128( (const __m128i *) ( b + 48 ) ) );
+		__m128i x = _mm_or_si128( _mm_or_si128( x0, x1 ), _mm_or_si128( x2, x3 ) );
+		if ( _mm_movemask_epi8( _mm_cmpeq_epi8( x, _mm_setzero_si128() ) ) != 0xffff )
+			return false;
+	}
+#endif
+	return memcmp( a, b, n ) == 0;
+}
+
+// Keeps a copy of what the destination shows and finds out which tiles of
+// a freshly captured rectangle really changed. Damage over-reports a lot
+// (whole windows get repainted), this keeps the uploads down to real change.
+struct tile_diff {
+	enum { tile_size = 64 };
+
+	int width, height, bytes_pp;
+	size_t stride;
+	std::vector< char > prev;
+	int tiles_x;
+	std::vector< bool > known;	// per tile, whether prev holds all of it
+	size_t unknown;				// tiles not known yet
+
+	tile_diff( int _width, int _height, int bits_per_pixel )
+		: width( _width ), height( _height ), bytes_pp( bits_per_pixel / 8 )
+		, stride( _width * bytes_pp ), prev( stride * _height )
+		, tiles_x( ( _width + tile_size - 1 ) / tile_size )
+		, known( tiles_x * ( ( _height + tile_size - 1 ) / tile_size ), false ), unknown( known.size() ) {}
+
+	// whether every tile was seen whole
+	bool complete() const {
+		return unknown == 0;
+	}
+
+	// img holds exactly the rectangle r (relative to the screen). Calls
+	// put( x, y, w, h ) relative to r for each run of changed tiles.
+	template < typename Fun >
+	void changed( const XRectangle &r, const XImage *img, Fun put ) {
+		int x_end = r.x + r.width, y_end = r.y + r.height;
+
+		for ( int ty = r.y; ty < y_end; ty = ( ty / tile_size + 1 ) * tile_size ) {
+			int th = std::min( ( ty / tile_size + 1 ) * tile_size, y_end ) - ty;
+			int run_start = -1;
+
+			for ( int tx = r.x; ; tx = ( tx / tile_size + 1 ) * tile_size ) {
+				bool dirty = false;
+				int tw = 0;
+
+				if ( tx < x_end ) {
+					tw = std::min( ( tx / tile_size + 1 ) * tile_size, x_end ) - tx;
+					dirty = update_tile( r, img, tx, ty, tw, th );
+				}
+
+				if ( dirty && run_start < 0 )
+					run_start = tx;
+				else if ( !dirty && run_start >= 0 ) {
+					put( run_start - r.x, ty - r.y, std::min( tx, x_end ) - run_start, th );
+					run_start = -1;
+				}
+
+				if ( tx >= x_end )
+					break;
+			}
+		}
+	}
+
+	// Compares (a part of) one tile with the previous frame and updates
+	// it. A tile is only compared once all of it was seen, so copies in
+	// parts, e.g. stripes, fill it in bit by bit.
+	bool update_tile( const XRectangle &r, const XImage *img, int tx, int ty, int tw, int th ) {
+		size_t len = tw * bytes_pp;
+		const char *src = img->data + ( ty - r.y ) * img->bytes_per_line + ( tx - r.x ) * bytes_pp;
+		char *old = &prev[ ty * stride + tx * bytes_pp ];
+		std::vector< bool >::reference seen = known[ ty / tile_size * tiles_x + tx / tile_size ];
+
+		int y = 0;
+		if ( seen )
+			for ( ; y < th; ++y )
+				if ( !mem_equal( src + y * img->bytes_per_line, old + y * stride, len ) )
+					break;
+
+		if ( y == th )
+			return false;
+
+		for ( ; y < th; ++y )
+			memcpy( old + y * stride, src + y * img->bytes_per_line, len );
+
+		if ( tx % tile_size == 0 && ty % tile_size == 0
+				&& ( tw == tile_size || tx + tw == width ) && ( th == tile_size || ty + th == height ) && !seen ) {
+			seen = true;
+			--unknown;
+		}
+		return true;
+	}
+};
+
+// Pixel formats known at compile time, for the conversion kernels below.
+template < uint32_t R, uint32_t G, uint32_t B, typename T >
+struct pixel_fmt {
+	typedef T pixel;
+	static const uint32_t red = R, green = G, blue = B;
+};
+
+typedef pixel_fmt< 0xff0000, 0xff00, 0xff, uint32_t > fmt_rgb888;
+typedef pixel_fmt< 0xff, 0xff00, 0xff0000, uint32_t > fmt_bgr888;
+typedef pixel_fmt< 0x3ff00000, 0xffc00, 0x3ff, uint32_t > fmt_rgb101010;
+typedef pixel_fmt< 0x3ff, 0xffc00, 0x3ff00000, uint32_t > fmt_bgr101010;
+typedef pixel_fmt< 0xf800, 0x7e0, 0x1f, uint16_t > fmt_rgb565;
+typedef pixel_fmt< 0x1f, 0x7e0, 0xf800, uint16_t > fmt_bgr565;
+
+int mask_shift( unsigned long m ) {
+	int s = 0;
+	for ( ; m && !( m & 1 ); m >>= 1 )
+		++s;
+	return s;
+}
+
+int mask_bits( unsigned long m ) {
+	int b = 0;
+	for ( m >>= mask_shift( m ); m & 1; m >>= 1 )
+		++b;
+	return b;
+}
+
+// Moves a channel from one mask to another, replicating the high bits
+// when widening so that full intensity stays full intensity.
+inline uint32_t convert_channel( uint32_t p, uint32_t src_mask, int src_shift, int src_bits,
+		int dst_shift, int dst_bits ) {
+	uint32_t v = ( p & src_mask ) >> src_shift;
+	if ( dst_bits <= src_bits )
+		v >>= src_bits - dst_bits;
+	else
+		v = ( v << ( dst_bits - src_bits ) ) | ( v >> ( 2 * src_bits - dst_bits > 0 ? 2 * src_bits - dst_bits : 0 ) );
+	return v << dst_shift;
+}
+
+// Converts a row of n pixels. The scalar version works for any pair of
+// formats; the masks are constants, so the compiler folds the shifts.
+template < typename S, typename D >
+struct pixel_converter {
+	static inline typename D::pixel convert( uint32_t p ) {
+		static const int rs = __builtin_ctz( S::red ), gs = __builtin_ctz( S::green ), bs = __builtin_ctz( S::blue );
+		static const int rd = __builtin_ctz( D::red ), gd = __builtin_ctz( D::green ), bd = __builtin_ctz( D::blue );
+		static const int rsb = __builtin_popcount( S::red ), gsb = __builtin_popcount( S::green ), bsb = __builtin_popcount( S::blue );
+		static const int rdb = __builtin_popcount( D::red ), gdb = __builtin_popcount( D::green ), bdb = __builtin_popcount( D::blue );
+		return convert_channel( p, S::red, rs, rsb, rd, rdb )
+			| convert_channel( p, S::green, gs, gsb, gd, gdb )
+			| convert_channel( p, S::blue, bs, bsb, bd, bdb );
+	}
+
+	static void scalar( const char *src, char *dst, int n ) {
+		const typename S::pixel *s = (const typename S::pixel *) src;
+		typename D::pixel *d = (typename D::pixel *) dst;
+		for ( int i = 0; i < n; ++i )
+			d[ i ] = convert( s[ i ] );
+	}
+
+	static void row( const char *src, char *dst, int n ) {
+		scalar( src, dst, n );
+	}
+};
+
+#ifdef __SSE2__
+
+// Swapping red and blue in 32 bit pixels is the common mismatch.
+__attribute__(( target( "avx2" ) ))
+int swap_rb_avx2( const char *src, char *dst, int n ) {
+	const __m256i shuf = _mm256_setr_epi8( 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 );
+	int i = 0;
+	for ( ; i + 8 <= n; i += 8 ) {
+		__m256i p = _mm256_loadu_si256( (const __m256i *) ( src + i * 4 ) );
+		_mm256_storeu_si256( (__m256i *) ( dst + i * 4 ), _mm256_shuffle_epi8( p, shuf ) );
+	}
+	return i;
+}
+
+template <>
+void pixel_converter< fmt_rgb888, fmt_bgr888 >::row( const char *src, char *dst, int n ) {
+	static const bool avx2 = __builtin_cpu_supports( "avx2" );
+	int i = avx2 ? swap_rb_avx2( src, dst, n ) : 0;
+
+	const __m128i ga = _mm_set1_epi32( 0xff00ff00 ), lo = _mm_set1_epi32( 0xff );
+	for ( ; i + 4 <= n; i += 4 ) {
+		__m128i p = _mm_loadu_si128( (const __m128i *) ( src + i * 4 ) );
+		__m128i r = _mm_or_si128( _mm_and_si128( p, ga ),
+			_mm_or_si128( _mm_slli_epi32( _mm_and_si128( p, lo ), 16 ), _mm_and_si128( _mm_srli_epi32( p, 16 ), lo ) ) );
+		_mm_storeu_si128( (__m128i *) ( dst + i * 4 ), r );
+	}
+	scalar( src + i * 4, dst + i * 4, n - i );
+}
+
+template <>
+void pixel_converter< fmt_bgr888, fmt_rgb888 >::row( const char *src, char *dst, int n ) {
+	// the same swap
+	pixel_converter< fmt_rgb888, fmt_bgr888 >::row( src, dst, n );
+}
+
+// 888 to 565: four pixels per 128 bits, packed to 16 bits each.
+inline __m128i rgb888_to_565_sse2( __m128i p ) {
+	__m128i r = _mm_and_si128( _mm_srli_epi32( p, 8 ), _mm_set1_epi32( 0xf800 ) );
+	__m128i g = _mm_and_si128( _mm_srli_epi32( p, 5 ), _mm_set1_epi32( 0x7e0 ) );
+	__m128i b = _mm_and_si128( _mm_srli_epi32( p, 3 ), _mm_set1_epi32( 0x1f ) );
+	return _mm_or_si128( r, _mm_or_si128( g, b ) );
+}
+
+__attribute__(( target( "avx2" ) ))
+int rgb888_to_565_avx2( const char *src, char *dst, int n ) {
+	const __m256i rm = _mm256_set1_epi32( 0xf800 ), gm = _mm256_set1_epi32( 0x7e0 ), bm = _mm256_set1_epi32( 0x1f );
+	int i = 0;
+	for ( ; i + 16 <= n; i += 16 ) {
+		__m256i q[ 2 ];
+		for ( int k = 0; k < 2; ++k ) {
+			__m256i p = _mm256_loadu_si256( (const __m256i *) ( src + ( i + k * 8 ) * 4 ) );
+			q[ k ] = _mm256_or_si256( _mm256_and_si256( _mm256_srli_epi32( p, 8 ), rm ),
+				_mm256_or_si256( _mm256_and_si256( _mm256_srli_epi32( p, 5 ), gm ),
+					_mm256_and_si256( _mm256_srli_epi32( p, 3 ), bm ) ) );
+		}
+		// packus works within 128 bit lanes, put the quadwords back in order
+		__m256i r = _mm256_permute4x64_epi64( _mm256_packus_epi32( q[ 0 ], q[ 1 ] ), 0xd8 );
+		_mm256_storeu_si256( (__m256i *) ( dst + i * 2 ), r );
+	}
+	return i;
+}
+
+template <>
+void pixel_converter< fmt_rgb888, fmt_rgb565 >::row( const char *src, char *dst, int n ) {
+	static const bool avx2 = __builtin_cpu_supports( "avx2" );
+	int i = avx2 ? rgb888_to_565_avx2( src, dst, n ) : 0;
+
+	// SSE2 only has a signed pack, so shift the values into its range
+	const __m128i bias32 = _mm_set1_epi32( 0x8000 ), bias16 = _mm_set1_epi16( (short) 0x8000 );
+	for ( ; i + 8 <= n; i += 8 ) {
+		__m128i a = _mm_sub_epi32( rgb888_to_565_sse2( _mm_loadu_si128( (const __m128i *) ( src + i * 4 ) ) ), bias32 );
+		__m128i b = _mm_sub_epi32( rgb888_to_565_sse2( _mm_loadu_si128( (const __m128i *) ( src + i * 4 + 16 ) ) ), bias32 );
+		_mm_storeu_si128( (__m128i *) ( dst + i * 2 ), _mm_xor_si128( _mm_packs_epi32( a, b ), bias16 ) );
+	}
+	scalar( src + i * 4, dst + i * 2, n - i );
+}
+
+template <>
+void pixel_converter< fmt_rgb888, fmt_rgb101010 >::row( const char *src, char *dst, int n ) {
+	const __m128i m = _mm_set1_epi32( 0xff );
+	int i = 0;
+	for ( ; i + 4 <= n; i += 4 ) {
+		__m128i p = _mm_loadu_si128( (const __m128i *) ( src + i * 4 ) );
+		__m128i r = _mm_and_si128( _mm_srli_epi32( p, 16 ), m );
+		__m128i g = _mm_and_si128( _mm_srli_epi32( p, 8 ), m );
+		__m128i b = _mm_and_si128( p, m );
+		// 8 to 10 bits: v << 2 | v >> 6
+		r = _mm_or_si128( _mm_slli_epi32( r, 2 ), _mm_srli_epi32( r, 6 ) );
+		g = _mm_or_si128( _mm_slli_epi32( g, 2 ), _mm_srli_epi32( g, 6 ) );
+		b = _mm_or_si128( _mm_slli_epi32( b, 2 ), _mm_srli_epi32( b, 6 ) );
+		__m128i q = _mm_or_si128( _mm_slli_epi32( r, 20 ), _mm_or_si128( _mm_slli_epi32( g, 10 ), b ) );
+		_mm_storeu_si128( (__m128i *) ( dst + i * 4 ), q );
+	}
+	scalar( src + i * 4, dst + i * 4, n - i );
+}
+
+#endif	// __SSE2__
+
+typedef void (*convert_row_fn)( const char *src, char *dst, int n );
+
+template < typename S, typename D >
+bool match_converter( const XImage *src, const XImage *dst, convert_row_fn &fn ) {
+	if ( src->bits_per_pixel != (int) sizeof( typename S::pixel ) * 8
+			|| dst->bits_per_pixel != (int) sizeof( typename D::pixel ) * 8
+			|| src->red_mask != S::red || src->green_mask != S::green || src->blue_mask != S::blue
+			|| dst->red_mask != D::red || dst->green_mask != D::green || dst->blue_mask != D::blue )
+		return false;
+
+	fn = &pixel_converter< S, D >::row;
+	return true;
+}
+
+template < typename S >
+bool match_converter_from( const XImage *src, const XImage *dst, convert_row_fn &fn ) {
+	return match_converter< S, fmt_rgb888 >( src, dst, fn )
+		|| match_converter< S, fmt_bgr888 >( src, dst, fn )
+		|| match_converter< S, fmt_rgb101010 >( src, dst, fn )
+		|| match_converter< S, fmt_bgr101010 >( src, dst, fn )
+		|| match_converter< S, fmt_rgb565 >( src, dst, fn )
+		|| match_converter< S, fmt_bgr565 >( src, dst, fn );
+}
+
+bool same_format( const XImage *src, const XImage *dst ) {
+	return src->bits_per_pixel == dst->bits_per_pixel
+		&& src->byte_order == dst->byte_order
+		&& src->red_mask == dst->red_mask
+		&& src->green_mask == dst->green_mask
+		&& src->blue_mask == dst->blue_mask;
+}
+
+// Picks a kernel for converting rows from src's to dst's format. NULL
+// means there is none and convert_rect falls back to XGetPixel/XPutPixel.
+convert_row_fn select_converter( const XImage *src, const XImage *dst ) {
+	convert_row_fn fn = NULL;
+	if ( src->byte_order != dst->byte_order )
+		return NULL;
+
+	match_converter_from< fmt_rgb888 >( src, dst, fn )
+		|| match_converter_from< fmt_bgr888 >( src, dst, fn )
+		|| match_converter_from< fmt_rgb101010 >( src, dst, fn )
+		|| match_converter_from< fmt_bgr101010 >( src, dst, fn )
+		|| match_converter_from< fmt_rgb565 >( src, dst, fn )
+		|| match_converter_from< fmt_bgr565 >( src, dst, fn );
+	return fn;
+}
+
+// Converts a whole image of the same size into another format.
+void convert_rect( convert_row_fn fn, const XImage *src, XImage *dst ) {
+	if ( fn ) {
+		for ( int y = 0; y < src->height; ++y )
+			fn( src->data + y * src->bytes_per_line, dst->data + y * dst->bytes_per_line, src->width );
+		return;
+	}
+
+	int rs = mask_shift( src->red_mask ), gs = mask_shift( src->green_mask ), bs = mask_shift( src->blue_mask );
+	int rsb = mask_bits( src->red_mask ), gsb = mask_bits( src->green_mask ), bsb = mask_bits( src->blue_mask );
+	int rd = mask_shift( dst->red_mask ), gd = mask_shift( dst->green_mask ), bd = mask_shift( dst->blue_mask );
+	int rdb = mask_bits( dst->red_mask ), gdb = mask_bits( dst->green_mask ), bdb = mask_bits( dst->blue_mask );
+
+	for ( int y = 0; y < src->height; ++y )
+		for ( int x = 0; x < src->width; ++x ) {
+			uint32_t p = XGetPixel( (XImage *) src, x, y );
+			XPutPixel( dst, x, y,
+				  convert_channel( p, src->red_mask, rs, rsb, rd, rdb )
+				| convert_channel( p, src->green_mask, gs, gsb, gd, gdb )
+				| convert_channel( p, src->blue_mask, bs, bsb, bd, bdb ) );
+		}
+}
+
+// Blends two pixels with 8 bit channels, w out of 256 of b.
+inline uint32_t lerp_pixel( uint32_t a, uint32_t b, uint32_t w ) {
+	uint32_t rb = ( ( ( a & 0xff00ff ) * ( 256 - w ) + ( b & 0xff00ff ) * w ) >> 8 ) & 0xff00ff;
+	uint32_t ag = ( ( ( a >> 8 ) & 0xff00ff ) * ( 256 - w ) + ( ( b >> 8 ) & 0xff00ff ) * w ) & 0xff00ff00;
+	return rb | ag;
+}
+
+// Blends two rows of n pixels into out, w out of 256 of b.
+void lerp_row( const uint32_t *a, const uint32_t *b, uint32_t w, uint32_t *out, int n ) {
+	int i = 0;
+	if ( w == 0 ) {
+		memcpy( out, a, n * 4 );
+		return;
+	}
+
+#ifdef __SSE2__
+	const __m128i wb = _mm_set1_epi16( w ), wa = _mm_set1_epi16( 256 - w ), zero = _mm_setzero_si128();
+	for ( ; i + 4 <= n; i += 4 ) {
+		__m128i pa = _mm_loadu_si128( (const __m128i *) ( a + i ) );
+		__m128i pb = _mm_loadu_si128( (const __m128i *) ( b + i ) );
+		__m128i lo = _mm_add_epi16( _mm_mullo_epi16( _mm_unpacklo_epi8( pa, zero ), wa ),
+			_mm_mullo_epi16( _mm_unpacklo_epi8( pb, zero ), wb ) );
+		__m128i hi = _mm_add_epi16( _mm_mullo_epi16( _mm_unpackhi_epi8( pa, zero ), wa ),
+			_mm_mullo_epi16( _mm_unpackhi_epi8( pb, zero ), wb ) );
+		_mm_storeu_si128( (__m128i *) ( out + i ),
+			_mm_packus_epi16( _mm_srli_epi16( lo, 8 ), _mm_srli_epi16( hi, 8 ) ) );
+	}
+#endif
+
+	for ( ; i < n; ++i )
+		out[ i ] = lerp_pixel( a[ i ], b[ i ], w );
+}
+
+#ifdef __SSE2__
+
+inline __m128i reverse_pixels( __m128i v ) {
+	return _mm_shuffle_epi32( v, 0x1b );
+}
+
+#endif
+
+// Maps the source screen onto a destination screen. The image is first
+// rotated and/or mirrored, which comes down to an optional transpose and
+// flips of the axes, and then optionally scaled, keeping the aspect ratio:
+// fit shows all of it with black borders, fill covers the whole
+// destination and crops. Captured rectangles are kept, already oriented,
+// in a shadow copy of the source and the destination is rendered from it
+// with a bilinear filter, using per-column and per-row coefficient tables.
+struct image_transform {
+	enum scale_mode { scale_none, scale_fit, scale_fill };
+
+	// what the user asked for
+	struct options {
+		scale_mode scale;
+		int rotation;	// clockwise, in degrees
+		bool mirror;	// left-right, after rotating
+
+		bool enabled() const {
+			return scale != scale_none || rotation != 0 || mirror;
+		}
+	};
+
+	int src_w, src_h, dst_w, dst_h;
+	bool transpose, flip_x, flip_y;
+	int img_w, img_h;				// oriented image, the size of shadow
+	int out_x, out_y, out_w, out_h;	// scaled image within the destination
+	bool unscaled;
+	unsigned long red_mask, green_mask, blue_mask;	// of the source
+	std::vector< uint32_t > shadow;
+
+	// for each destination column/row: first image pixel (-1 if black)
+	// and weight of the next one
+	std::vector< int > x0, y0;
+	std::vector< uint32_t > wx, wy;
+	std::vector< uint32_t > blend_row, out_row;
+
+	image_transform( const XImage *src_image, int _dst_w, int _dst_h, const options &opt )
+		: src_w( src_image->width ), src_h( src_image->height ), dst_w( _dst_w ), dst_h( _dst_h )
+		, red_mask( src_image->red_mask ), green_mask( src_image->green_mask ), blue_mask( src_image->blue_mask )
+	{
+		if ( src_image->bits_per_pixel != 32 || mask_bits( red_mask ) != 8 || mask_bits( green_mask ) != 8
+				|| mask_bits( blue_mask ) != 8 || mask_shift( red_mask | green_mask | blue_mask ) != 0 )
+			ERR2( "transforming the image needs a 24 bit source" );
+
+		switch ( opt.rotation ) {
+		case 0:   transpose = false; flip_x = false; flip_y = false; break;
+		case 90:  transpose = true;  flip_x = true;  flip_y = false; break;
+		case 180: transpose = false; flip_x = true;  flip_y = true;  break;
+		case 270: transpose = true;  flip_x = false; flip_y = true;  break;
+		default:  ERR2( "rotation must be 0, 90, 180 or 270" );
+		}
+		flip_x ^= opt.mirror;
+
+		img_w = transpose ? src_h : src_w;
+		img_h = transpose ? src_w : src_h;
+		shadow.resize( img_w * img_h );
+		blend_row.resize( img_w );
+		out_row.resize( dst_w );
+
+		double sx = (double) dst_w / img_w, sy = (double) dst_h / img_h;
+		double s = opt.scale == scale_fill ? std::max( sx, sy ) : opt.scale == scale_fit ? std::min( sx, sy ) : 1;
+		out_w = img_w * s + 0.5;
+		out_h = img_h * s + 0.5;
+		out_x = opt.scale == scale_none ? 0 : ( dst_w - out_w ) / 2;
+		out_y = opt.scale == scale_none ? 0 : ( dst_h - out_h ) / 2;
+		unscaled = out_w == img_w && out_h == img_h;
+
+		make_table( dst_w, out_x, out_w, img_w, x0, wx );
+		make_table( dst_h, out_y, out_h, img_h, y0, wy );
+	}
+
+	static void make_table( int dst, int out, int out_size, int src, std::vector< int > &first, std::vector< uint32_t > &weight ) {
+		first.resize( dst );
+		weight.resize( dst );
+		for ( int i = 0; i < dst; ++i ) {
+			if ( i < out || i >= out + out_size ) {
+				first[ i ] = -1;
+				weight[ i ] = 0;
+				continue;
+			}
+
+			double u = std::max( 0.0, ( i - out + 0.5 ) * src / out_size - 0.5 );
+			int u0 = std::min( (int) u, src - 1 );
+			first[ i ] = u0;
+			weight[ i ] = u0 + 1 < src ? ( u - u0 ) * 256 + 0.5 : 0;
+		}
+	}
+
+	// Position of source pixel (x, y) in the oriented image.
+	void orient( int &x, int &y ) const {
+		if ( transpose )
+			std::swap( x, y );
+		if ( flip_x )
+			x = img_w - 1 - x;
+		if ( flip_y )
+			y = img_h - 1 - y;
+	}
+
+	XRectangle orient_rect( const XRectangle &r ) const {
+		int x1 = r.x, y1 = r.y, x2 = r.x + r.width - 1, y2 = r.y + r.height - 1;
+		orient( x1, y1 );
+		orient( x2, y2 );
+
+		XRectangle o = { (short) std::min( x1, x2 ), (short) std::min( y1, y2 ),
+			(unsigned short) ( std::abs( x2 - x1 ) + 1 ), (unsigned short) ( std::abs( y2 - y1 ) + 1 ) };
+		return o;
+	}
+
+	// Destination rectangle (relative to the destination screen) that
+	// depends on source rectangle r. Empty if it's cropped away.
+	XRectangle map_rect( const XRectangle &r ) const {
+		XRectangle o = orient_rect( r );
+
+		int x1, x2, y1, y2;
+		if ( unscaled ) {
+			x1 = out_x + o.x;
+			y1 = out_y + o.y;
+			x2 = x1 + o.width;
+			y2 = y1 + o.height;
+		} else {
+			x1 = map_low( o.x, img_w, out_x, out_w ), x2 = map_high( o.x + o.width, img_w, out_x, out_w );
+			y1 = map_low( o.y, img_h, out_y, out_h ), y2 = map_high( o.y + o.height, img_h, out_y, out_h );
+		}
+		x1 = std::max( x1, 0 ); y1 = std::max( y1, 0 );
+		x2 = std::min( x2, dst_w ); y2 = std::min( y2, dst_h );
+
+		XRectangle d = { (short) x1, (short) y1, (unsigned short) std::max( x2 - x1, 0 ), (unsigned short) std::max( y2 - y1, 0 ) };
+		return d;
+	}
+
+	// the filter reaches one source pixel to each side
+	static int map_low( int v, int src, int out, int out_size ) {
+		return out + (int64_t) ( v - 1 ) * out_size / src - 1;
+	}
+
+	static int map_high( int v, int src, int out, int out_size ) {
+		return out + ( (int64_t) ( v + 1 ) * out_size + src - 1 ) / src + 1;
+	}
+
+	void map_point( int &x, int &y ) const {
+		orient( x, y );
+		x = out_x + (int64_t) x * out_w / img_w;
+		y = out_y + (int64_t) y * out_h / img_h;
+	}
+
+	// Stores a captured rectangle (relative to the source screen).
+	void update( const XRectangle &r, const XImage *img ) {
+		const uint32_t *src = (const uint32_t *) img->data;
+		size_t stride = img->bytes_per_line / 4;
+
+		if ( transpose )
+			update_transposed( r, src, stride );
+		else
+			for ( int y = 0; y < r.height; ++y ) {
+				int u = r.x, v = r.y + y;
+				orient( u, v );
+				const uint32_t *s = src + y * stride;
+				uint32_t *d = &shadow[ v * img_w + u ];
+
+				if ( !flip_x )
+					memcpy( d, s, r.width * 4 );
+				else
+					reverse_row( s, d - r.width + 1, r.width );
+			}
+	}
+
+	static void reverse_row( const uint32_t *s, uint32_t *d, int n ) {
+		int i = 0;
+#ifdef __SSE2__
+		for ( ; i + 4 <= n; i += 4 )
+			_mm_storeu_si128( (__m128i *) ( d + n - i - 4 ),
+				reverse_pixels( _mm_loadu_si128( (const __m128i *) ( s + i ) ) ) );
+#endif
+		for ( ; i < n; ++i )
+			d[ n - 1 - i ] = s[ i ];
+	}
+
+	// Source rows become image columns. Goes through the rectangle in
+	// blocks that fit in the cache, 4x4 pixels at a time.
+	void update_transposed( const XRectangle &r, const uint32_t *src, size_t stride ) {
+		enum { block = 64 };
+
+		for ( int by = 0; by < r.height; by += block )
+			for ( int bx = 0; bx < r.width; bx += block ) {
+				int ey = std::min( by + block, (int) r.height ), ex = std::min( bx + block, (int) r.width );
+				int y = by;
+
+#ifdef __SSE2__
+				for ( ; y + 4 <= ey; y += 4 ) {
+					int x = bx;
+					for ( ; x + 4 <= ex; x += 4 ) {
+						const uint32_t *s = src + y * stride + x;
+						__m128i r0 = _mm_loadu_si128( (const __m128i *) s );
+						__m128i r1 = _mm_loadu_si128( (const __m128i *) ( s + stride ) );
+						__m128i r2 = _mm_loadu_si128( (const __m128i *) ( s + 2 * stride ) );
+						__m128i r3 = _mm_loadu_si128( (const __m128i *) ( s + 3 * stride ) );
+
+						__m128i t0 = _mm_unpacklo_epi32( r0, r1 ), t1 = _mm_unpacklo_epi32( r2, r3 );
+						__m128i t2 = _mm_unpackhi_epi32( r0, r1 ), t3 = _mm_unpackhi_epi32( r2, r3 );
+						__m128i c[ 4 ] = { _mm_unpacklo_epi64( t0, t1 ), _mm_unpackhi_epi64( t0, t1 ),
+							_mm_unpacklo_epi64( t2, t3 ), _mm_unpackhi_epi64( t2, t3 ) };
+
+						// column k of the source block is row k of the image block
+						for ( int k = 0; k < 4; ++k ) {
+							int u = r.x + x + k, v = r.y + y;
+							orient( u, v );
+							if ( flip_x )
+								_mm_storeu_si128( (__m128i *) &shadow[ v * img_w + u - 3 ], reverse_pixels( c[ k ] ) );
+							else
+								_mm_storeu_si128( (__m128i *) &shadow[ v * img_w + u ], c[ k ] );
+						}
+					}
+
+					for ( ; x < ex; ++x )
+						for ( int k = 0; k < 4; ++k )
+							put_pixel( r.x + x, r.y + y + k, src[ ( y + k ) * stride + x ] );
+				}
+#endif
+
+				for ( ; y < ey; ++y )
+					for ( int x = bx; x < ex; ++x )
+						put_pixel( r.x + x, r.y + y, src[ y * stride + x ] );
+			}
+	}
+
+	void put_pixel( int x, int y, uint32_t p ) {
+		orient( x, y );
+		shadow[ y * img_w + x ] = p;
+	}
+
+	// Renders destination rectangle d into img, converting to its format.
+	void render( const XRectangle &d, XImage *img, bool convert, convert_row_fn fn ) {
+		if ( unscaled ) {
+			render_unscaled( d, img, convert, fn );
+			return;
+		}
+
+		int xs = -1, xe = -1;
+		for ( int i = d.x; i < d.x + d.width; ++i )
+			if ( x0[ i ] >= 0 ) {
+				if ( xs < 0 )
+					xs = x0[ i ];
+				xe = std::min( x0[ i ] + 2, img_w );
+			}
+
+		for ( int j = 0; j < d.height; ++j ) {
+			uint32_t *out = &out_row[ 0 ];
+			int sy = y0[ d.y + j ];
+
+			if ( sy < 0 || xs < 0 )
+				memset( out, 0, d.width * 4 );
+			else {
+				int sy1 = std::min( sy + 1, img_h - 1 );
+				lerp_row( &shadow[ sy * img_w + xs ], &shadow[ sy1 * img_w + xs ], wy[ d.y + j ],
+					&blend_row[ xs ], xe - xs );
+
+				for ( int i = 0; i < d.width; ++i ) {
+					int sx = x0[ d.x + i ];
+					if ( sx < 0 )
+						out[ i ] = 0;
+					else
+						out[ i ] = lerp_pixel( blend_row[ sx ], blend_row[ std::min( sx + 1, img_w - 1 ) ], wx[ d.x + i ] );
+				}
+			}
+
+			emit_row( out, img, j, d.width, convert, fn );
+		}
+	}
+
+	// Only rotated or mirrored: copy rows of the shadow, black outside.
+	void render_unscaled( const XRectangle &d, XImage *img, bool convert, convert_row_fn fn ) {
+		int xs = std::max( (int) d.x, out_x ), xe = std::min( d.x + d.width, out_x + out_w );
+
+		for ( int j = 0; j < d.height; ++j ) {
+			int sy = y0[ d.y + j ];
+			uint32_t *out = &out_row[ 0 ];
+
+			if ( sy < 0 || xs >= xe )
+				memset( out, 0, d.width * 4 );
+			else {
+				memset( out, 0, ( xs - d.x ) * 4 );
+				memcpy( out + xs - d.x, &shadow[ sy * img_w + xs - out_x ], ( xe - xs ) * 4 );
+				memset( out + xe - d.x, 0, ( d.x + d.width - xe ) * 4 );
+			}
+
+			emit_row( out, img, j, d.width, convert, fn );
+		}
+	}
+
+	// Writes n pixels in the source format into row y of img.
+	void emit_row( const uint32_t *row, XImage *img, int y, int n, bool convert, convert_row_fn fn ) const {
+		char *line = img->data + y * img->bytes_per_line;
+		if ( !convert )
+			memcpy( line, row, n * 4 );
+		else if ( fn )
+			fn( (const char *) row, line, n );
+		else {
+			XImage src_row = *img;
+			src_row.width = n;
+			src_row.height = 1;
+			src_row.bits_per_pixel = 32;
+			src_row.bytes_per_line = n * 4;
+			src_row.red_mask = red_mask;
+			src_row.green_mask = green_mask;
+			src_row.blue_mask = blue_mask;
+			src_row.depth = 24;
+			src_row.data = (char *) row;
+			XInitImage( &src_row );
+
+			XImage dst_row = sub_image( img, line, n, 1 );
+			convert_rect( NULL, &src_row, &dst_row );
+		}
+	}
+};
+
+// Shared memory for all images. Segments are made large, once, preferably
+// of huge pages, and touched right away so no frame stalls on page faults.
+// Buffers are carved out of them and go back to them when a clone is set
+// up anew. A segment is attached once to each connection that uses it.
+struct shm_block {
+	char *data;
+	size_t size;
+	int segment;
+};
+
+struct shm_arena {
+	enum {
+		min_segment = 32 << 20,
+		huge_page = 2 << 20,
+		alignment = 4096,
+	};
+
+	struct range {
+		size_t offset, size;
+	};
+
+	struct segment {
+		int shmid;
+		char *addr;
+		size_t size;
+		std::vector< range > free;	// sorted by offset
+		std::map< Display *, XShmSegmentInfo > attached;
+	};
+
+	std::mutex mutex;
+	std::deque< segment > segments;	// a deque so the infos handed out stay put
+	size_t limit;	// bytes at most, 0 for no limit
+
+	shm_arena() : limit( (size_t) 1024 << 20 ) {}
+
+	~shm_arena() {
+		for ( auto s = segments.begin(); s != segments.end(); ++s )
+			shmdt( s->addr );
+	}
+
+	shm_block alloc( size_t size ) {
+		std::lock_guard< std::mutex > guard( mutex );
+		size = ( size + alignment - 1 ) / alignment * alignment;
+
+		for ( size_t i = 0; i < segments.size(); ++i ) {
+			std::vector< range > &free = segments[ i ].free;
+			for ( auto r = free.begin(); r != free.end(); ++r )
+				if ( r->size >= size ) {
+					shm_block b = { segments[ i ].addr + r->offset, size, (int) i };
+					r->offset += size;
+					r->size -= size;
+					if ( !r->size )
+						free.erase( r );
+					stats.shm_used += size;
+					return b;
+				}
+		}
+
+		size_t seg_size = ( std::max( size, (size_t) min_segment ) + huge_page - 1 ) / huge_page * huge_page;
+		if ( limit && stats.shm_reserved + seg_size > limit ) {
+			// the last segment may be smaller
+			seg_size = ( size + huge_page - 1 ) / huge_page * huge_page;
+			if ( stats.shm_reserved + seg_size > limit )
+				ERR2( "shared memory limit reached (-B)" );
+		}
+
+		segment seg;
+		seg.shmid = shmget( IPC_PRIVATE, seg_size, IPC_CREAT | SHM_HUGETLB | 0666 );
+		if ( seg.shmid >= 0 )
+			stats.shm_huge += seg_size;
+		else
+			seg.shmid = shmget( IPC_PRIVATE, seg_size, IPC_CREAT | 0666 );
+		if ( seg.shmid < 0 )
+			ERR2( std::string( "shmget: " ) + strerror( errno ) );
+
+		seg.addr = (char *) shmat( seg.shmid, 0, 0 );
+		shmctl( seg.shmid, IPC_RMID, NULL );
+		if ( seg.addr == (char *) -1 )
+			ERR2( std::string( "shmat: " ) + strerror( errno ) );
+
+		// fault all pages in now instead of during the first frames
+		memset( seg.addr, 0, seg_size );
+
+		seg.size = seg_size;
+		range rest = { size, seg_size - size };
+		if ( rest.size )
+			seg.free.push_back( rest );
+		segments.push_back( seg );
+		stats.shm_reserved += seg_size;
+		stats.shm_used += size;
+
+		shm_block b = { seg.addr, size, (int) segments.size() - 1 };
+		return b;
+	}
+
+	void release( const shm_block &b ) {
+		std::lock_guard< std::mutex > guard( mutex );
+		segment &seg = segments[ b.segment ];
+		range r = { (size_t) ( b.data - seg.addr ), b.size };
+
+		auto next = seg.free.begin();
+		while ( next != seg.free.end() && next->offset < r.offset )
+			++next;
+		next = seg.free.insert( next, r );
+
+		// merge with the neighbours
+		if ( next + 1 != seg.free.end() && next->offset + next->size == ( next + 1 )->offset ) {
+			next->size += ( next + 1 )->size;
+			seg.free.erase( next + 1 );
+		}
+		if ( next != seg.free.begin() && ( next - 1 )->offset + ( next - 1 )->size == next->offset ) {
+			( next - 1 )->size += next->size;
+			seg.free.erase( next );
+		}
+		stats.shm_used -= b.size;
+	}
+
+	// The segment info to put into images of b used on dpy, the segment is
+	// attached to dpy the first time.
+	XShmSegmentInfo *attach( const shm_block &b, Display *dpy ) {
+		std::lock_guard< std::mutex > guard( mutex );
+		segment &seg = segments[ b.segment ];
+		auto a = seg.attached.find( dpy );
+		if ( a != seg.attached.end() )
+			return &a->second;
+
+		XShmSegmentInfo &info = seg.attached[ dpy ];
+		info.shmid = seg.shmid;
+		info.shmaddr = seg.addr;
+		info.readOnly = False;
+		if ( !XShmAttach( dpy, &info ) ) ERR;
+		return &info;
+	}
+
+	// Forgets a connection that is about to be closed.
+	void detach( Display *dpy ) {
+		std::lock_guard< std::mutex > guard( mutex );
+		for ( auto s = segments.begin(); s != segments.end(); ++s ) {
+			auto a = s->attached.find( dpy );
+			if ( a != s->attached.end() ) {
+				XShmDetach( dpy, &a->second );
+				s->attached.erase( a );
+			}
+		}
+	}
+
+	// An image of the default visual of dpy, without data yet.
+	static XImage *create_image( Display *dpy, int width, int height ) {
+		XShmSegmentInfo unattached;
+		XImage *img = XShmCreateImage( dpy, DefaultVisual( dpy, DefaultScreen( dpy ) ),
+			DefaultDepth( dpy, DefaultScreen( dpy ) ), ZPixmap, NULL, &unattached, width, height );
+		if ( !img ) ERR;
+		img->obdata = NULL;
+		return img;
+	}
+
+	// Gives img the pixels in b, used on dpy.
+	void use( XImage *img, const shm_block &b, Display *dpy ) {
+		img->data = b.data;
+		img->obdata = (char *) attach( b, dpy );
+	}
+
+	// Destroys an image whose pixels and segment info belong to the arena.
+	static void destroy_image( XImage *img ) {
+		img->data = img->obdata = NULL;
+		XDestroyImage( img );
+	}
+};
+
+shm_arena shm_pool;
+
+// A SHM buffer attached to both servers. Damaged rectangles are captured
+// into it packed one after another, each through its own sub-image, and
+// put to the destination from there. If the two visuals differ or the
+// image is transformed, the destination gets a buffer of its own and
+// captured pixels are converted or rendered into it.
+struct shm_buffer {
+	shm_block src_block, dst_block;
+	XImage *src_image, *dst_image;
+	size_t src_size, dst_size;
+	bool convert, separate;
+	convert_row_fn converter;
+	std::vector< XRectangle > src_rects, dst_rects;	// relative to the screens
+	std::vector< size_t > src_offsets, dst_offsets;
+	uint64_t damage_time;	// when the captured damage came in, 0 if unknown
+
+	shm_buffer( Display *src_dpy, Display *dst_dpy, int src_width, int src_height, int dst_width, int dst_height, bool transform ) {
+		src_image = shm_arena::create_image( src_dpy, src_width, src_height );
+		dst_image = shm_arena::create_image( dst_dpy, dst_width, dst_height );
+
+		convert = !same_format( src_image, dst_image );
+		converter = convert ? select_converter( src_image, dst_image ) : NULL;
+		separate = convert || transform;
+
+		if ( separate ) {
+			src_size = src_image->bytes_per_line * src_height;
+			dst_size = dst_image->bytes_per_line * dst_height;
+			src_block = shm_pool.alloc( src_size );
+			dst_block = shm_pool.alloc( dst_size );
+		} else {
+			src_size = dst_size = std::max( src_image->bytes_per_line, dst_image->bytes_per_line ) * src_height;
+			src_block = dst_block = shm_pool.alloc( src_size );
+		}
+		shm_pool.use( src_image, src_block, src_dpy );
+		shm_pool.use( dst_image, dst_block, dst_dpy );
+	}
+
+	~shm_buffer() {
+		shm_pool.release( src_block );
+		if ( separate )
+			shm_pool.release( dst_block );
+
+		shm_arena::destroy_image( src_image );
+		shm_arena::destroy_image( dst_image );
+	}
+
+	// Whether e is about a put from this buffer.
+	bool holds( const XShmCompletionEvent &e ) const {
+		const XShmSegmentInfo *info = (const XShmSegmentInfo *) dst_image->obdata;
+		size_t start = dst_block.data - info->shmaddr;
+		return e.shmseg == info->shmseg && e.offset >= start && e.offset < start + dst_block.size;
+	}
+
+	// Places rects in the segment(s), returns false if they don't fit.
+	// Unless separate, both lists must be the same.
+	bool layout( const std::vector< XRectangle > &_src_rects, const std::vector< XRectangle > &_dst_rects ) {
+		src_rects = _src_rects;
+		dst_rects = _dst_rects;
+
+		if ( !separate ) {
+			src_offsets.clear();
+			size_t offset = 0;
+			for ( auto r = src_rects.begin(); r != src_rects.end(); ++r ) {
+				src_offsets.push_back( offset );
+				offset += std::max( sub_image( src_image, NULL, r->width, r->height ).bytes_per_line,
+					sub_image( dst_image, NULL, r->width, r->height ).bytes_per_line ) * r->height;
+			}
+			dst_offsets = src_offsets;
+			return offset <= src_size;
+		}
+
+		return place( src_image, src_rects, src_offsets ) <= src_size
+			&& place( dst_image, dst_rects, dst_offsets ) <= dst_size;
+	}
+
+	static size_t place( const XImage *img, const std::vector< XRectangle > &rects, std::vector< size_t > &offsets ) {
+		offsets.clear();
+		size_t offset = 0;
+		for ( auto r = rects.begin(); r != rects.end(); ++r ) {
+			offsets.push_back( offset );
+			offset += sub_image( img, NULL, r->width, r->height ).bytes_per_line * r->height;
+		}
+		return offset;
+	}
+
+	void layout_full() {
+		XRectangle s = { 0, 0, (unsigned short) src_image->width, (unsigned short) src_image->height };
+		XRectangle d = { 0, 0, (unsigned short) dst_image->width, (unsigned short) dst_image->height };
+		layout( std::vector< XRectangle >( 1, s ), std::vector< XRectangle >( 1, separate ? d : s ) );
+	}
+
+	XImage src_sub( size_t i ) const {
+		return sub_image( src_image, src_image->data + src_offsets[ i ], src_rects[ i ].width, src_rects[ i ].height );
+	}
+
+	XImage dst_sub( size_t i ) const {
+		return sub_image( dst_image, dst_image->data + dst_offsets[ i ], dst_rects[ i ].width, dst_rects[ i ].height );
+	}
+};
+
+// A single XShmPutImage, collected so that the last one of a frame can ask
+// for a completion event.
+struct put_request {
+	XImage image;
+	int src_x, src_y, dst_x, dst_y;
+	unsigned width, height;
+};
+
+// XFixes hands out cursor pixels as longs, Xcursor wants ints.
+void narrow_pixels( const unsigned long *src, unsigned int *dst, size_t n ) {
+	size_t i = 0;
+	if ( sizeof( *src ) == sizeof( *dst ) ) {
+		memcpy( dst, src, n * sizeof( *dst ) );
+		return;
+	}
+
+#ifdef __SSE2__
+	// keep the low halves of four longs
+	for ( ; i + 4 <= n; i += 4 ) {
+		__m128i a = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *) ( src + i ) ), _MM_SHUFFLE( 3, 1, 2, 0 ) );
+		__m128i b = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *) ( src + i + 2 ) ), _MM_SHUFFLE( 3, 1, 2, 0 ) );
+		_mm_storeu_si128( (__m128i *) ( dst + i ), _mm_unpacklo_epi64( a, b ) );
+	}
+#endif
+
+	for ( ; i < n; ++i )
+		dst[ i ] = src[ i ];
+}
+
+// The source cursor, drawn into the cloned image instead of moving the
+// destination pointer (-C). The main thread moves it, the capture reads it,
+// maybe from another thread.
+struct soft_cursor {
+	std::mutex mutex;
+	std::vector< uint32_t > pixels;	// premultiplied ARGB
+	int width, height, xhot, yhot;
+	int x, y;			// pointer position in root window coordinates
+	XRectangle shown;	// where it was when last redrawn, and is drawn
+	std::vector< uint32_t > shown_pixels;	// what is drawn there
+	bool dirty;			// moved or changed since
+
+	soft_cursor() : width( 0 ), height( 0 ), xhot( 0 ), yhot( 0 ), x( 0 ), y( 0 ), dirty( false ) {
+		memset( &shown, 0, sizeof( shown ) );
+	}
+
+	// Whether it can be drawn into images like img.
+	static bool supported( const XImage *img ) {
+		return img->bits_per_pixel == 32 && img->red_mask == 0xff0000
+			&& img->green_mask == 0xff00 && img->blue_mask == 0xff;
+	}
+
+	void move( int _x, int _y ) {
+		std::lock_guard< std::mutex > guard( mutex );
+		x = _x;
+		y = _y;
+		dirty = true;
+	}
+
+	void set_image( const XFixesCursorImage *cur ) {
+		std::lock_guard< std::mutex > guard( mutex );
+		width = cur->width;
+		height = cur->height;
+		xhot = cur->xhot;
+		yhot = cur->yhot;
+		pixels.resize( width * height );
+		narrow_pixels( cur->pixels, (unsigned int *) &pixels[ 0 ], pixels.size() );
+		dirty = true;
+	}
+
+	// Whether it moved or changed since the last call. before and after
+	// are the rectangles to redraw, in root window coordinates.
+	bool changed( XRectangle &before, XRectangle &after ) {
+		std::lock_guard< std::mutex > guard( mutex );
+		if ( !dirty )
+			return false;
+
+		dirty = false;
+		before = shown;
+		XRectangle r = { (short) ( x - xhot ), (short) ( y - yhot ), (unsigned short) width, (unsigned short) height };
+		after = shown = r;
+		shown_pixels = pixels;
+		return true;
+	}
+
+	// Blends the cursor into img, which holds the rectangle at img_x, img_y
+	// in root window coordinates. It's drawn where the last changed() put
+	// it, whose rectangles are damaged, even if it has moved since.
+	void draw( XImage *img, int img_x, int img_y ) {
+		std::lock_guard< std::mutex > guard( mutex );
+		int cx = shown.x - img_x, cy = shown.y - img_y;
+		int x1 = std::max( cx, 0 ), y1 = std::max( cy, 0 );
+		int x2 = std::min( cx + shown.width, img->width ), y2 = std::min( cy + shown.height, img->height );
+
+		for ( int row = y1; row < y2; ++row ) {
+			uint32_t *dst = (uint32_t *) ( img->data + row * img->bytes_per_line );
+			const uint32_t *src = &shown_pixels[ ( row - cy ) * shown.width + x1 - cx ];
+			for ( int col = x1; col < x2; ++col )
+				dst[ col ] = blend_pixel( *src++, dst[ col ] );
+		}
+	}
+
+	// c over d, c premultiplied
+	static uint32_t blend_pixel( uint32_t c, uint32_t d ) {
+		uint32_t a = c >> 24;
+		if ( a == 0xff )
+			return c;
+
+		uint32_t rb = ( d & 0xff00ff ) * ( 255 - a ), g = ( d & 0xff00 ) * ( 255 - a );
+		rb = ( ( rb + 0x800080 + ( ( rb >> 8 ) & 0xff00ff ) ) >> 8 ) & 0xff00ff;
+		g = ( ( g + 0x8000 + ( ( g >> 8 ) & 0xff00 ) ) >> 8 ) & 0xff00;
+		return ( c + ( rb | g ) ) & 0xffffff;
+	}
+};
+
+// Plays a recording of screenclone -o as the source (-i): its tiles are
+// the damage and what is captured, its pointer moves and cursors go to the
+// mouse_replayer. So a real-world trace goes through the same copy path
+// as a live source. The recording is mapped and walked in place, like
+// screenclone-receiver -r does.
+struct recording_player {
+	struct cursor_entry {
+		XFixesCursorImage image;
+		std::vector< unsigned long > pixels;
+	};
+
+	const char *data;
+	size_t size, offset;
+	bool timed;
+	uint64_t started;	// when the first chunk was played
+	int width, height;
+	std::vector< uint32_t > shadow;	// the recorded screen as of the last chunk
+	std::mutex mutex;	// shadow is read by the capture, maybe from another thread
+	std::map< uint32_t, cursor_entry > cursors;
+	uint64_t frames;
+
+	// timed plays at the recorded pace, otherwise as fast as possible
+	recording_player( const std::string &path, bool _timed )
+		: offset( 0 ), timed( _timed ), started( 0 ), frames( 0 )
+	{
+		int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+		struct stat st;
+		if ( fd < 0 || fstat( fd, &st ) )
+			ERR2( "can't open " + path + ": " + strerror( errno ) );
+		size = st.st_size;
+		data = (const char *) mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		close( fd );
+		if ( data == MAP_FAILED ) ERR;
+		madvise( (void *) data, size, MADV_SEQUENTIAL );
+
+		// the recording starts with the hello
+		const stream_header *header = (const stream_header *) ( data + sizeof( stream_chunk ) );
+		const stream_hello *hello = (const stream_hello *) ( header + 1 );
+		if ( size < sizeof( stream_chunk ) + sizeof( *header ) + sizeof( *hello )
+				|| header->type != stream_msg_hello || hello->magic != stream_magic || hello->version != stream_version )
+			ERR2( path + " isn't a recording of screenclone -o" );
+		width = hello->width;
+		height = hello->height;
+		shadow.resize( width * height );
+	}
+
+	~recording_player() {
+		munmap( (void *) data, size );
+	}
+
+	// The recorded screen, at the origin of the root window.
+	xinerama_screen screen( const display &d ) const {
+		XineramaScreenInfo info;
+		memset( &info, 0, sizeof( info ) );
+		info.screen_number = -1;
+		info.width = width;
+		info.height = height;
+		return xinerama_screen( d, info );
+	}
+
+	bool done() const {
+		return offset + sizeof( stream_chunk ) > size;
+	}
+
+	// When the next chunk is to be played.
+	uint64_t due() const {
+		uint64_t now = microtime();
+		if ( !timed || !started )
+			return now;
+		return std::max( started + ( (const stream_chunk *) ( data + offset ) )->time, now );
+	}
+
+	// Plays the next chunk. Calls damaged( rect ) for each tile, pointer(
+	// x, y ) for pointer moves (-1, -1 if it left the screen) and cursor(
+	// image ) for cursor changes, with an image that stays valid.
+	template < typename DamagedFn, typename PointerFn, typename CursorFn >
+	void play( DamagedFn damaged, PointerFn pointer, CursorFn cursor ) {
+		const stream_chunk &chunk = * (const stream_chunk *) ( data + offset );
+		offset += sizeof( chunk );
+		if ( chunk.magic != stream_chunk_magic || chunk.length > size - offset )
+			ERR2( "broken recording" );
+		if ( !started )
+			started = microtime() - chunk.time;
+
+		const char *p = data + offset, *end = p + chunk.length;
+		offset += chunk.length;
+		while ( end - p >= (ptrdiff_t) sizeof( stream_header ) ) {
+			const stream_header &header = * (const stream_header *) p;
+			p += sizeof( header );
+			if ( header.length > (size_t) ( end - p ) || header.length % sizeof( uint32_t ) )
+				ERR2( "broken recording" );
+			const uint32_t *payload = (const uint32_t *) p;
+			size_t words = header.length / sizeof( uint32_t );
+			p += header.length;
+
+			switch ( header.type ) {
+			case stream_msg_hello: {
+				const stream_hello &hello = * (const stream_hello *) payload;
+				if ( header.length < sizeof( hello ) || hello.width != width || hello.height != height )
+					ERR2( "the recorded screen changes size" );
+				break;
+			}
+			case stream_msg_tile: {
+				const stream_tile &t = * (const stream_tile *) payload;
+				size_t skip = sizeof( t ) / sizeof( uint32_t );
+				if ( header.length < sizeof( t ) || t.x + t.width > width || t.y + t.height > height )
+					ERR2( "tile outside the screen" );
+				{
+					std::lock_guard< std::mutex > guard( mutex );
+					if ( !stream_decode( payload + skip, words - skip, (char *) &shadow[ t.y * width + t.x ],
+							width * sizeof( uint32_t ), t.width, t.height ) )
+						ERR2( "broken tile" );
+				}
+				XRectangle r = { (short) t.x, (short) t.y, t.width, t.height };
+				damaged( r );
+				break;
+			}
+			case stream_msg_frame_end:
+				++frames;
+				break;
+			case stream_msg_pointer: {
+				const stream_pointer &ptr = * (const stream_pointer *) payload;
+				if ( header.length < sizeof( ptr ) )
+					ERR2( "broken pointer" );
+				if ( ptr.visible )
+					pointer( ptr.x, ptr.y );
+				else
+					pointer( -1, -1 );
+				break;
+			}
+			case stream_msg_cursor: {
+				const stream_cursor &c = * (const stream_cursor *) payload;
+				size_t skip = sizeof( c ) / sizeof( uint32_t );
+				if ( header.length < sizeof( c ) )
+					ERR2( "broken cursor" );
+				if ( c.width && c.height ) {
+					if ( words - skip < (size_t) c.width * c.height )
+						ERR2( "broken cursor" );
+					cursor_entry &e = cursors[ c.serial ];
+					e.pixels.assign( payload + skip, payload + skip + c.width * c.height );
+					memset( &e.image, 0, sizeof( e.image ) );
+					e.image.width = c.width;
+					e.image.height = c.height;
+					e.image.xhot = c.xhot;
+					e.image.yhot = c.yhot;
+					e.image.cursor_serial = c.serial;
+					e.image.pixels = &e.pixels[ 0 ];
+				}
+				auto known = cursors.find( c.serial );
+				if ( known != cursors.end() )
+					cursor( &known->second.image );
+				break;
+			}
+			default:
+				// newer messages we don't know, skip them
+				break;
+			}
+		}
+	}
+
+	// Copies r of the recorded screen into img, which is the size of r and
+	// 32 bit xRGB.
+	void read( const XRectangle &r, XImage *img ) {
+		std::lock_guard< std::mutex > guard( mutex );
+		for ( int y = 0; y < r.height; ++y )
+			memcpy( img->data + y * img->bytes_per_line, &shadow[ ( r.y + y ) * width + r.x ], r.width * sizeof( uint32_t ) );
+	}
+};
+
+// Where the damage of a source screen goes: a destination screen, or a
+// stream. clone_loop hands it the damage and says when to copy.
+struct damage_sink {
+	virtual ~damage_sink() {}
+
+	// the part of the source root window that is copied
+	virtual const xinerama_screen &source() const = 0;
+
+	// rec is in root window coordinates, when as in damage_region::add
+	virtual void damage( const XRectangle &rec, uint64_t when = 0 ) = 0;
+
+	virtual void copy_if_damaged() = 0;
+
+	// whether damage is left over from the last copy, to go on right away
+	virtual bool behind() const { return false; }
+
+	// the pointer, in root window coordinates
+	virtual void focus( int x, int y ) {}
+
+	// whether all damage it was given is on the destination
+	virtual bool idle() = 0;
+};
+
+struct image_replayer : damage_sink {
+	const display *src, *dst;
+	xinerama_screen src_screen;	// moves with a cloned window
+	const xinerama_screen dst_screen;
+	window src_window, dst_window;
+	damage_region damage_rects;
+	std::unique_ptr< tile_diff > diff;
+	std::unique_ptr< image_transform > transform;
+
+	// connections for capturing and presenting, own ones when pipelined
+	std::unique_ptr< display > capture_own, present_own;
+	const display *capture_dpy, *present_dpy;
+	GC dst_gc;
+	int shm_event;
+	std::vector< std::unique_ptr< shm_buffer > > buffers;
+	std::vector< put_request > puts;
+
+	// pipelined mode: damage waiting for capture and buffers between threads;
+	// otherwise free_buffers and the ones still read by the destination
+	bool pipelined;
+	std::mutex mutex;
+	std::condition_variable cond;
+	damage_region pending;
+	std::deque< shm_buffer * > free_buffers, ready_buffers, in_flight;
+	bool stopping;
+	std::thread capture_worker, present_worker;
+	std::exception_ptr failed;	// thrown by a thread, for the main thread
+
+	// Big updates when not pipelined: the damage is cut into stripes, the
+	// ones nearest to the pointer go first, and one copy takes only as many
+	// as fit into chunk_budget. The rest is copied in the next iterations
+	// of the main loop, so pointer and damage events are handled in between.
+	enum { stripe_height = 64 };
+	uint64_t chunk_budget;	// us per copy, 0 for everything at once
+	double pixels_per_us;	// measured, to size the chunks
+	int focus_x, focus_y;	// the pointer, relative to the source screen
+	bool chunks_left;		// damage is left over from the last copy
+	bool held_back;			// a frame waits for a free buffer
+
+	soft_cursor *cursor;	// drawn into the captured pixels, NULL if not
+	int capture_x, capture_y;	// where the source screen is in src_window
+	recording_player *player;	// captured from instead of the source, NULL if not
+
+	// If the destination has shared pixmaps, what is put goes into a full
+	// frame in shared memory instead, and from its pixmap onto the screen
+	// with XCopyArea. Exposures are then repainted without another upload.
+	shm_block frame_block;
+	XImage *frame;	// NULL if not used
+	Pixmap frame_pixmap;
+
+	// ring is the number of buffers for pipelined mode, 0 to copy
+	// synchronously with at most uploads frames in flight
+	image_replayer( const display &_src, const display &_dst, const xinerama_screen &_src_screen, const xinerama_screen &_dst_screen,
+			bool use_tile_diff, int ring, int uploads, uint64_t _chunk_budget, soft_cursor *_cursor,
+			bool use_pixmap, const image_transform::options &transform_opt, recording_player *_player )
+		: src( &_src ), dst( &_dst)
+		, src_screen( _src_screen ), dst_screen( _dst_screen )
+		, src_window( src->root() ), dst_window( dst->root() )
+		, damage_rects( src_screen.info.width, src_screen.info.height )
+		, capture_dpy( src ), present_dpy( dst )
+		, pipelined( ring > 0 )
+		, pending( src_screen.info.width, src_screen.info.height )
+		, stopping( false )
+		, chunk_budget( _chunk_budget ), pixels_per_us( 100 ), focus_x( 0 ), focus_y( 0 ), chunks_left( false ), held_back( false )
+		, cursor( _cursor ), capture_x( src_screen.info.x_org ), capture_y( src_screen.info.y_org ), player( _player )
+		, frame( NULL ), frame_pixmap( None )
+	{
+		// the initial full copy comes through damage_rects
+		pending.clear();
+
+		if ( pipelined ) {
+			capture_own.reset( new display( src->clone() ) );
+			present_own.reset( new display( dst->clone() ) );
+			capture_dpy = capture_own.get();
+			present_dpy = present_own.get();
+		}
+
+		// copies from the frame pixmap shouldn't send NoExpose events
+		XGCValues gc_values;
+		gc_values.graphics_exposures = False;
+		dst_gc = XCreateGC( present_dpy->dpy, dst_window.win, GCGraphicsExposures, &gc_values );
+		shm_event = XShmGetEventBase( present_dpy->dpy );
+
+		bool transformed = transform_opt.enabled();
+		int dst_width = transformed ? dst_screen.info.width : src_screen.info.width;
+		int dst_height = transformed ? dst_screen.info.height : src_screen.info.height;
+
+		for ( int i = 0; i < ( pipelined ? ring : std::max( uploads, 1 ) ); ++i ) {
+			buffers.push_back( std::unique_ptr< shm_buffer >( new shm_buffer( capture_dpy->dpy, present_dpy->dpy,
+				src_screen.info.width, src_screen.info.height, dst_width, dst_height, transformed ) ) );
+			free_buffers.push_back( buffers.back().get() );
+		}
+
+		if ( cursor && !soft_cursor::supported( buffers[ 0 ]->src_image ) )
+			ERR2( "drawing the cursor needs a 32 bit xRGB source" );
+		if ( player && !soft_cursor::supported( buffers[ 0 ]->src_image ) )
+			ERR2( "replaying needs a 32 bit xRGB target" );
+
+		if ( transformed )
+			transform.reset( new image_transform( buffers[ 0 ]->src_image, dst_width, dst_height, transform_opt ) );
+
+		if ( use_tile_diff )
+			diff.reset( new tile_diff( dst_width, dst_height, buffers[ 0 ]->dst_image->bits_per_pixel ) );
+
+		if ( use_pixmap && shared_pixmaps( present_dpy->dpy ) ) {
+			frame = shm_arena::create_image( present_dpy->dpy, dst_width, dst_height );
+			frame_block = shm_pool.alloc( frame->bytes_per_line * dst_height );
+			shm_pool.use( frame, frame_block, present_dpy->dpy );
+			frame_pixmap = XShmCreatePixmap( present_dpy->dpy, dst_window.win, frame->data,
+				(XShmSegmentInfo *) frame->obdata, dst_width, dst_height, frame->depth );
+		}
+
+		if ( pipelined ) {
+			// make sure the segments are attached before other connections use them
+			XSync( capture_dpy->dpy, False );
+			XSync( present_dpy->dpy, False );
+
+			capture_worker = std::thread( &image_replayer::run_thread, this, &image_replayer::capture_thread );
+			present_worker = std::thread( &image_replayer::run_thread, this, &image_replayer::present_thread );
+		}
+	}
+
+	~image_replayer() {
+		if ( pipelined ) {
+			{
+				std::lock_guard< std::mutex > guard( mutex );
+				stopping = true;
+				cond.notify_all();
+			}
+			capture_worker.join();
+			present_worker.join();
+		}
+
+		buffers.clear();
+		if ( frame ) {
+			XFreePixmap( present_dpy->dpy, frame_pixmap );
+			XSync( present_dpy->dpy, False );
+			shm_pool.release( frame_block );
+			shm_arena::destroy_image( frame );
+		}
+		XFreeGC( present_dpy->dpy, dst_gc );
+		if ( capture_own ) {
+			shm_pool.detach( capture_own->dpy );
+			XCloseDisplay( capture_own->dpy );
+		}
+		if ( present_own ) {
+			shm_pool.detach( present_own->dpy );
+			XCloseDisplay( present_own->dpy );
+		}
+	}
+
+	void copy_if_damaged() {
+		if ( damage_rects.empty() )
+			return;
+
+		damage_rects.merge();
+
+		if ( pipelined ) {
+			std::lock_guard< std::mutex > guard( mutex );
+			if ( failed )
+				std::rethrow_exception( failed );
+			// the capture thread hasn't taken the last frame's damage yet
+			if ( !pending.empty() )
+				++stats.dropped_frames;
+			pending.add( damage_rects );
+			cond.notify_all();
+		} else {
+			if ( free_buffers.empty() || ( frame && !in_flight.empty() ) ) {
+				// The destination is behind, or still copying from the
+				// only frame. Keep the damage, the newest content is
+				// captured once it has caught up; until then the main
+				// loop waits for the completion.
+				if ( !held_back )
+					++stats.dropped_frames;
+				held_back = true;
+				chunks_left = false;
+				return;
+			}
+			held_back = false;
+
+			shm_buffer *buf = free_buffers.front();
+			free_buffers.pop_front();
+
+			uint64_t start = microtime();
+			size_t pixels;
+			damage_region chunk = next_chunk( pixels );
+			capture( *buf, chunk );
+			if ( present( *buf, true ) )
+				in_flight.push_back( buf );
+			else {
+				presented( *buf );
+				free_buffers.push_back( buf );
+			}
+
+			uint64_t took = microtime() - start;
+			if ( took && pixels > 0 )
+				pixels_per_us = ( pixels_per_us + (double) pixels / took ) / 2;
+			chunks_left = !damage_rects.empty();
+			return;
+		}
+
+		DBG( std::cout << "damaged" << std::endl );
+
+		damage_rects.clear();
+	}
+
+	// Captures from drawable instead of the root window, with the source
+	// screen at x, y in it. For a window, through its Composite pixmap.
+	void capture_from( Drawable drawable, int x, int y ) {
+		src_window.win = drawable;
+		capture_x = x;
+		capture_y = y;
+	}
+
+	// The cloned window has moved to x_org, y_org on the root window; its
+	// pixmap and size are the same.
+	void moved( int x_org, int y_org ) {
+		src_screen.info.x_org = x_org;
+		src_screen.info.y_org = y_org;
+	}
+
+	const xinerama_screen &source() const {
+		return src_screen;
+	}
+
+	bool behind() const {
+		return chunks_left;
+	}
+
+	bool idle() {
+		if ( !damage_rects.empty() )
+			return false;
+		if ( !pipelined )
+			return in_flight.empty();
+		std::lock_guard< std::mutex > guard( mutex );
+		return pending.empty() && ready_buffers.empty() && free_buffers.size() == buffers.size();
+	}
+
+	void focus( int x, int y ) {
+		focus_x = x - src_screen.info.x_org;
+		focus_y = y - src_screen.info.y_org;
+	}
+
+	// Takes the damage for one copy out of damage_rects, the stripes
+	// nearest to the pointer first. pixels is set to the area taken.
+	damage_region next_chunk( size_t &pixels ) {
+		damage_region chunk = damage_rects;
+		damage_rects.clear();
+		pixels = chunk.full ? (size_t) chunk.width * chunk.height : 0;
+		for ( auto r = chunk.rects.begin(); r != chunk.rects.end(); ++r )
+			pixels += (size_t) r->width * r->height;
+
+		// Transformed stripes don't cover whole tiles, so the tile diff
+		// gets the first full copy in one piece.
+		size_t budget = std::max( pixels_per_us * chunk_budget, (double) chunk.width * stripe_height );
+		if ( !chunk_budget || pixels <= budget || ( diff && !diff->complete() && chunk.full ) )
+			return chunk;
+
+		std::vector< XRectangle > rects = chunk.list();
+
+		std::vector< XRectangle > stripes;
+		for ( auto r = rects.begin(); r != rects.end(); ++r )
+			for ( int y = r->y; y < r->y + r->height; y = ( y / stripe_height + 1 ) * stripe_height ) {
+				int y_end = std::min( ( y / stripe_height + 1 ) * stripe_height, r->y + r->height );
+				XRectangle s = { r->x, (short) y, r->width, (unsigned short) ( y_end - y ) };
+				stripes.push_back( s );
+			}
+
+		// by the distance of the pointer to the nearest point of the stripe
+		auto distance = [&]( const XRectangle &s ) {
+			int dx = std::max( std::max( s.x - focus_x, focus_x - ( s.x + s.width - 1 ) ), 0 );
+			int dy = std::max( std::max( s.y - focus_y, focus_y - ( s.y + s.height - 1 ) ), 0 );
+			return (int64_t) dx * dx + (int64_t) dy * dy;
+		};
+		std::stable_sort( stripes.begin(), stripes.end(), [&]( const XRectangle &a, const XRectangle &b ) {
+			return distance( a ) < distance( b );
+		} );
+
+		uint64_t since = chunk.since;
+		chunk.clear();
+		pixels = 0;
+		for ( auto s = stripes.begin(); s != stripes.end(); ++s ) {
+			size_t area = (size_t) s->width * s->height;
+			if ( !pixels || pixels + area <= budget ) {
+				chunk.add( s->x, s->y, s->width, s->height );
+				pixels += area;
+			} else
+				damage_rects.add( s->x, s->y, s->width, s->height );
+		}
+		chunk.since = damage_rects.since = since;
+		chunk.merge();
+		return chunk;
+	}
+
+	// Captures the damaged rectangles, or the whole screen if they don't fit.
+	void capture( shm_buffer &buf, const damage_region &region ) {
+		if ( region.full || !buf.layout( region.rects, dst_rects( region ) ) )
+			buf.layout_full();
+		buf.damage_time = region.since;
+
+		get_images( buf );
+
+		if ( transform )
+			for ( size_t i = 0; i < buf.dst_rects.size(); ++i ) {
+				XImage dst_sub = buf.dst_sub( i );
+				transform->render( buf.dst_rects[ i ], &dst_sub, buf.convert, buf.converter );
+			}
+	}
+
+	// Captures the source rectangles of buf, calling captured() for each.
+	void get_images( shm_buffer &buf ) {
+		if ( player ) {
+			for ( size_t i = 0; i < buf.src_rects.size(); ++i ) {
+				XImage sub = buf.src_sub( i );
+				player->read( buf.src_rects[ i ], &sub );
+				captured( buf, i );
+			}
+			return;
+		}
+
+#ifdef ENABLE_XCB
+		// Send all requests before waiting for the first reply, the server
+		// reads the next rectangle while this one is converted.
+		xcb_connection_t *conn = capture_dpy->conn;
+		const XShmSegmentInfo *info = (const XShmSegmentInfo *) buf.src_image->obdata;
+		std::vector< xcb_shm_get_image_cookie_t > cookies;
+		for ( size_t i = 0; i < buf.src_rects.size(); ++i ) {
+			const XRectangle &r = buf.src_rects[ i ];
+			cookies.push_back( xcb_shm_get_image( conn, src_window.win,
+				capture_x + r.x, capture_y + r.y, r.width, r.height,
+				~0u, XCB_IMAGE_FORMAT_Z_PIXMAP, info->shmseg, buf.src_image->data - info->shmaddr + buf.src_offsets[ i ] ) );
+		}
+		xcb_flush( conn );
+
+		for ( size_t i = 0; i < buf.src_rects.size(); ++i ) {
+			xcb_generic_error_t *error = NULL;
+			xcb_shm_get_image_reply_t *reply = TM( get_image, xcb_shm_get_image_reply( conn, cookies[ i ], &error ) );
+			// no reply and no error if the connection is broken
+			if ( !reply || error ) {
+				free( reply );
+				free( error );
+				ERR2( "ShmGetImage failed" );
+			}
+			free( reply );
+			captured( buf, i );
+		}
+#else
+		for ( size_t i = 0; i < buf.src_rects.size(); ++i ) {
+			const XRectangle &r = buf.src_rects[ i ];
+			XImage sub = buf.src_sub( i );
+			TM( get_image, XShmGetImage( capture_dpy->dpy, src_window.win, &sub,
+					capture_x + r.x, capture_y + r.y, AllPlanes ) );
+			captured( buf, i );
+		}
+#endif	// ENABLE_XCB
+	}
+
+	// Takes rectangle i, which has arrived in the buffer, to the destination
+	// format or the shadow image.
+	void captured( shm_buffer &buf, size_t i ) {
+		XImage sub = buf.src_sub( i );
+		stats.bytes_captured += (uint64_t) sub.bytes_per_line * sub.height;
+
+		if ( cursor )
+			cursor->draw( &sub, src_screen.info.x_org + buf.src_rects[ i ].x, src_screen.info.y_org + buf.src_rects[ i ].y );
+
+		if ( transform )
+			transform->update( buf.src_rects[ i ], &sub );
+		else if ( buf.convert ) {
+			XImage dst_sub = buf.dst_sub( i );
+			convert_rect( buf.converter, &sub, &dst_sub );
+		}
+	}
+
+	// Destination rectangles to update for the given damage.
+	std::vector< XRectangle > dst_rects( const damage_region &region ) const {
+		if ( !transform )
+			return region.rects;
+
+		damage_region dst_region( transform->dst_w, transform->dst_h );
+		dst_region.clear();
+		for ( auto r = region.rects.begin(); r != region.rects.end(); ++r ) {
+			XRectangle d = transform->map_rect( *r );
+			dst_region.add( d.x, d.y, d.width, d.height );
+		}
+		dst_region.merge();
+		return dst_region.list();
+	}
+
+	static bool shared_pixmaps( Display *dpy ) {
+		int major, minor;
+		Bool pixmaps;
+		return XShmQueryVersion( dpy, &major, &minor, &pixmaps ) && pixmaps && XShmPixmapFormat( dpy ) == ZPixmap;
+	}
+
+	// Uploads what was captured into buf. Returns whether a completion
+	// event for the buffer will come.
+	bool present( shm_buffer &buf, bool completion ) {
+		puts.clear();
+		for ( size_t i = 0; i < buf.dst_rects.size(); ++i )
+			put( buf.dst_rects[ i ], buf.dst_sub( i ) );
+
+		if ( frame )
+			return blit( completion );
+
+		for ( auto p = puts.begin(); p != puts.end(); ++p ) {
+			TM( put_image, XShmPutImage( present_dpy->dpy, dst_window.win, dst_gc, &p->image, p->src_x, p->src_y,
+					p->dst_x, p->dst_y, p->width, p->height, completion && p + 1 == puts.end() ) );
+			stats.bytes_uploaded += (uint64_t) p->width * p->height * p->image.bits_per_pixel / 8;
+		}
+		TM( flush, XFlush( present_dpy->dpy ) );
+		++stats.frames;
+
+		return completion && !puts.empty();
+	}
+
+	// present() through the frame pixmap. The copies of the last batch must
+	// be done before the frame is written again, the caller waits for the
+	// completion in between.
+	bool blit( bool completion ) {
+		int bpp = frame->bits_per_pixel / 8;
+		for ( auto p = puts.begin(); p != puts.end(); ++p ) {
+			int x = p->dst_x - dst_screen.info.x_org, y = p->dst_y - dst_screen.info.y_org;
+			for ( unsigned row = 0; row < p->height; ++row )
+				memcpy( frame->data + ( y + row ) * frame->bytes_per_line + x * bpp,
+					p->image.data + ( p->src_y + row ) * p->image.bytes_per_line + p->src_x * bpp, p->width * bpp );
+
+			TM( put_image, XCopyArea( present_dpy->dpy, frame_pixmap, dst_window.win, dst_gc, x, y,
+					p->width, p->height, p->dst_x, p->dst_y ) );
+			stats.bytes_uploaded += (uint64_t) p->width * p->height * bpp;
+		}
+
+		// The copies have no completion events; putting a pixel of the
+		// frame onto itself does, after them.
+		bool marked = completion && !puts.empty();
+		if ( marked )
+			XShmPutImage( present_dpy->dpy, frame_pixmap, dst_gc, frame, 0, 0, 0, 0, 1, 1, True );
+
+		TM( flush, XFlush( present_dpy->dpy ) );
+		++stats.frames;
+		return marked;
+	}
+
+	// Repaints an exposed area of the destination root window from the
+	// frame pixmap. Returns false without one.
+	bool exposed( const XExposeEvent &e ) {
+		if ( !frame )
+			return false;
+
+		int x_org = dst_screen.info.x_org, y_org = dst_screen.info.y_org;
+		int x1 = std::max( e.x, x_org ), y1 = std::max( e.y, y_org );
+		int x2 = std::min( e.x + e.width, x_org + frame->width ), y2 = std::min( e.y + e.height, y_org + frame->height );
+		if ( x1 >= x2 || y1 >= y2 )
+			return true;
+
+		++stats.exposures;
+		XCopyArea( present_dpy->dpy, frame_pixmap, dst_window.win, dst_gc,
+			x1 - x_org, y1 - y_org, x2 - x1, y2 - y1, x1, y1 );
+		XFlush( present_dpy->dpy );
+		return true;
+	}
+
+	// Whether e says the destination is done with buf.
+	bool put_done( const shm_buffer &buf, const XShmCompletionEvent &e ) const {
+		if ( !frame )
+			return buf.holds( e );
+
+		const XShmSegmentInfo *info = (const XShmSegmentInfo *) frame->obdata;
+		return e.shmseg == info->shmseg && e.offset == (unsigned long) ( frame->data - info->shmaddr );
+	}
+
+	// Queues upload of rectangle r (relative to the destination screen)
+	// from img, which holds exactly that rectangle.
+	void put( const XRectangle &r, const XImage &img ) {
+		if ( !diff ) {
+			put_request p = { img, 0, 0, dst_screen.info.x_org + r.x, dst_screen.info.y_org + r.y,
+				r.width, r.height };
+			puts.push_back( p );
+			return;
+		}
+
+		diff->changed( r, &img, [&]( int x, int y, int w, int h ) {
+			put_request p = { img, x, y, dst_screen.info.x_org + r.x + x, dst_screen.info.y_org + r.y + y,
+				(unsigned) w, (unsigned) h };
+			puts.push_back( p );
+		} );
+	}
+
+	void presented( const shm_buffer &buf ) {
+		if ( buf.damage_time )
+			stats.damage_to_present.add( microtime() - buf.damage_time );
+	}
+
+	// Takes a ShmCompletion from the destination connection when not
+	// pipelined. Returns whether it was for one of our buffers.
+	bool completed( const XShmCompletionEvent &e ) {
+		for ( auto b = in_flight.begin(); b != in_flight.end(); ++b )
+			if ( put_done( **b, e ) ) {
+				presented( **b );
+				free_buffers.push_back( *b );
+				in_flight.erase( b );
+				return true;
+			}
+		return false;
+	}
+
+	// Blocks until the destination has read the buffer, or is lost.
+	void wait_completion( const shm_buffer &buf ) {
+		for ( ;; ) {
+			XEvent e;
+			if ( !present_dpy->wait_event( e ) )
+				return;
+			if ( e.type == shm_event + ShmCompletion
+					&& put_done( buf, * (XShmCompletionEvent *) &e ) )
+				return;
+		}
+	}
+
+	// Runs one of the threads. What it throws ends it and comes out of the
+	// next copy_if_damaged instead, as if the copy was synchronous.
+	void run_thread( void ( image_replayer::*body )() ) {
+		try {
+			( this->*body )();
+		} catch ( ... ) {
+			std::lock_guard< std::mutex > guard( mutex );
+			failed = std::current_exception();
+		}
+	}
+
+	void capture_thread() {
+		damage_region region( src_screen.info.width, src_screen.info.height );
+
+		for ( ;; ) {
+			shm_buffer *buf;
+			{
+				std::unique_lock< std::mutex > lock( mutex );
+				cond.wait( lock, [&]{ return stopping || ( !pending.empty() && !free_buffers.empty() ); } );
+				if ( stopping )
+					return;
+
+				buf = free_buffers.front();
+				free_buffers.pop_front();
+
+				pending.merge();
+				region = pending;
+				pending.clear();
+			}
+
+			capture( *buf, region );
+
+			std::lock_guard< std::mutex > guard( mutex );
+			ready_buffers.push_back( buf );
+			cond.notify_all();
+		}
+	}
+
+	void present_thread() {
+		for ( ;; ) {
+			shm_buffer *buf;
+			{
+				std::unique_lock< std::mutex > lock( mutex );
+				cond.wait( lock, [&]{ return stopping || !ready_buffers.empty(); } );
+				if ( stopping )
+					return;
+
+				buf = ready_buffers.front();
+				ready_buffers.pop_front();
+			}
+
+			if ( present( *buf, true ) )
+				wait_completion( *buf );
+			presented( *buf );
+
+			std::lock_guard< std::mutex > guard( mutex );
+			free_buffers.push_back( buf );
+			cond.notify_all();
+		}
+	}
+
+	void damage( const XRectangle &rec, uint64_t when = 0 ) {
+		damage_rects.add( rec, src_screen, when );
+	}
+};
+
+// One destination of a fanout_replayer. It has its own connection and
+// thread, and damage of its own: while it's busy, new damage piles up and
+// is put in one go from the latest frame, without holding up the capture
+// or the other sinks. What it puts is first copied from the shared frame
+// into one of its own, which only changes between its puts.
+struct fanout_sink {
+	display dpy;
+	const xinerama_screen dst_screen;
+	window dst_window;
+	GC gc;
+	int shm_event;
+	const XImage *frame;	// written by the capture under frame_mutex
+	std::mutex &frame_mutex;
+	shm_block block;
+	XImage *image;			// what the server reads from
+	const XShmSegmentInfo *info;
+	std::unique_ptr< tile_diff > diff;
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	damage_region pending;
+	bool busy;	// putting a frame
+	bool stopping;
+	std::thread worker;
+
+	fanout_sink( const display &dst, const xinerama_screen &_dst_screen, const XImage *_frame,
+			std::mutex &_frame_mutex, bool use_tile_diff )
+		: dpy( dst.clone() ), dst_screen( _dst_screen ), dst_window( dpy.root() )
+		, frame( _frame ), frame_mutex( _frame_mutex )
+		, pending( frame->width, frame->height ), busy( false ), stopping( false )
+	{
+		// the first frame is copied in full, when it's there
+		pending.clear();
+
+		gc = XCreateGC( dpy.dpy, dst_window.win, 0, NULL );
+		shm_event = XShmGetEventBase( dpy.dpy );
+		image = shm_arena::create_image( dpy.dpy, frame->width, frame->height );
+		block = shm_pool.alloc( image->bytes_per_line * image->height );
+		shm_pool.use( image, block, dpy.dpy );
+		info = (const XShmSegmentInfo *) image->obdata;
+		XSync( dpy.dpy, False );
+
+		if ( use_tile_diff )
+			diff.reset( new tile_diff( frame->width, frame->height, frame->bits_per_pixel ) );
+
+		worker = std::thread( &fanout_sink::present_thread, this );
+	}
+
+	~fanout_sink() {
+		{
+			std::lock_guard< std::mutex > guard( mutex );
+			stopping = true;
+			cond.notify_all();
+		}
+		worker.join();
+
+		shm_pool.detach( dpy.dpy );
+		shm_pool.release( block );
+		shm_arena::destroy_image( image );
+		XFreeGC( dpy.dpy, gc );
+		XCloseDisplay( dpy.dpy );
+	}
+
+	void damaged( const damage_region &region ) {
+		std::lock_guard< std::mutex > guard( mutex );
+		// still busy with an older frame, this one is merged into the next
+		if ( !pending.empty() )
+			++stats.dropped_frames;
+		pending.add( region );
+		cond.notify_all();
+	}
+
+	void present_thread() {
+		damage_region region( image->width, image->height );
+		std::vector< put_request > puts;
+
+		for ( ;; ) {
+			{
+				std::unique_lock< std::mutex > lock( mutex );
+				cond.wait( lock, [&]{ return stopping || !pending.empty(); } );
+				if ( stopping )
+					return;
+
+				pending.merge();
+				region = pending;
+				pending.clear();
+				busy = true;
+			}
+
+			std::vector< XRectangle > rects = region.list();
+
+			// the last put is done, the server doesn't read image now
+			int bytes_pp = image->bits_per_pixel / 8;
+			{
+				std::lock_guard< std::mutex > guard( frame_mutex );
+				for ( auto r = rects.begin(); r != rects.end(); ++r )
+					for ( int y = r->y; y < r->y + r->height; ++y )
+						memcpy( image->data + y * image->bytes_per_line + r->x * bytes_pp,
+							frame->data + y * frame->bytes_per_line + r->x * bytes_pp, r->width * bytes_pp );
+			}
+
+			puts.clear();
+			for ( auto r = rects.begin(); r != rects.end(); ++r ) {
+				if ( !diff ) {
+					put_request p = { *image, r->x, r->y, dst_screen.info.x_org + r->x, dst_screen.info.y_org + r->y,
+						r->width, r->height };
+					puts.push_back( p );
+					continue;
+				}
+
+				// the rectangle within the frame, for comparing
+				XImage sub = *image;
+				sub.data += r->y * image->bytes_per_line + r->x * bytes_pp;
+				sub.width = r->width;
+				sub.height = r->height;
+				diff->changed( *r, &sub, [&]( int x, int y, int w, int h ) {
+					put_request p = { *image, r->x + x, r->y + y, dst_screen.info.x_org + r->x + x,
+						dst_screen.info.y_org + r->y + y, (unsigned) w, (unsigned) h };
+					puts.push_back( p );
+				} );
+			}
+
+			for ( auto p = puts.begin(); p != puts.end(); ++p ) {
+				TM( put_image, XShmPutImage( dpy.dpy, dst_window.win, gc, image, p->src_x, p->src_y,
+						p->dst_x, p->dst_y, p->width, p->height, p + 1 == puts.end() ) );
+				stats.bytes_uploaded += (uint64_t) p->width * p->height * bytes_pp;
+			}
+			TM( flush, XFlush( dpy.dpy ) );
+
+			// the server reads the frame after the request, wait for that
+			// before looking at new damage
+			while ( !puts.empty() ) {
+				XEvent e;
+				if ( !dpy.wait_event( e ) )
+					break;
+				if ( e.type == shm_event + ShmCompletion
+						&& ( (XShmCompletionEvent *) &e )->shmseg == info->shmseg )
+					break;
+			}
+
+			if ( region.since )
+				stats.damage_to_present.add( microtime() - region.since );
+
+			std::lock_guard< std::mutex > guard( mutex );
+			busy = false;
+		}
+	}
+
+	bool idle() {
+		std::lock_guard< std::mutex > guard( mutex );
+		return !busy && pending.empty();
+	}
+};
+
+// Clones one source screen to several destination screens with a single
+// capture. Damaged rectangles are captured once into a frame in shared
+// memory, which every sink puts from on its own. The source side costs
+// the same however many sinks there are. The frame is only written and
+// read under frame_mutex, never by a server. Only for copies as they are:
+// no transform and the same pixel format on both sides.
+struct fanout_replayer : damage_sink {
+	const display *src;
+	const xinerama_screen src_screen;
+	window src_window;
+	damage_region damage_rects;
+	shm_block frame_block, staging_block;
+	XImage *frame, *staging;	// the whole screen, and packed captures
+	std::mutex frame_mutex;
+	std::vector< std::unique_ptr< fanout_sink > > sinks;
+	recording_player *player;	// captured from instead of the source, NULL if not
+
+	fanout_replayer( const display &_src, const display &dst, const xinerama_screen &_src_screen,
+			const std::vector< xinerama_screen > &dst_screens, bool use_tile_diff, recording_player *_player )
+		: src( &_src ), src_screen( _src_screen ), src_window( src->root() )
+		, damage_rects( src_screen.info.width, src_screen.info.height ), player( _player )
+	{
+		frame = create( frame_block );
+		staging = create( staging_block );
+
+		for ( auto d = dst_screens.begin(); d != dst_screens.end(); ++d )
+			sinks.push_back( std::unique_ptr< fanout_sink >( new fanout_sink( dst, *d, frame, frame_mutex, use_tile_diff ) ) );
+	}
+
+	~fanout_replayer() {
+		sinks.clear();
+		shm_pool.release( staging_block );
+		shm_pool.release( frame_block );
+		shm_arena::destroy_image( frame );
+		shm_arena::destroy_image( staging );
+	}
+
+	XImage *create( shm_block &block ) {
+		XImage *img = shm_arena::create_image( src->dpy, src_screen.info.width, src_screen.info.height );
+		block = shm_pool.alloc( img->bytes_per_line * img->height );
+		shm_pool.use( img, block, src->dpy );
+		return img;
+	}
+
+	// Whether the destination takes the source's pixels as they are.
+	static bool supported( const display &src, const display &dst ) {
+		XImage *a = XCreateImage( src.dpy, DefaultVisual( src.dpy, DefaultScreen( src.dpy ) ),
+			DefaultDepth( src.dpy, DefaultScreen( src.dpy ) ), ZPixmap, 0, NULL, 1, 1, 32, 0 );
+		XImage *b = XCreateImage( dst.dpy, DefaultVisual( dst.dpy, DefaultScreen( dst.dpy ) ),
+			DefaultDepth( dst.dpy, DefaultScreen( dst.dpy ) ), ZPixmap, 0, NULL, 1, 1, 32, 0 );
+		bool same = a && b && same_format( a, b );
+		if ( a )
+			XDestroyImage( a );
+		if ( b )
+			XDestroyImage( b );
+		return same;
+	}
+
+	void damage( const XRectangle &rec, uint64_t when = 0 ) {
+		damage_rects.add( rec, src_screen, when );
+	}
+
+	const xinerama_screen &source() const {
+		return src_screen;
+	}
+
+	bool idle() {
+		if ( !damage_rects.empty() )
+			return false;
+		for ( auto s = sinks.begin(); s != sinks.end(); ++s )
+			if ( !(*s)->idle() )
+				return false;
+		return true;
+	}
+
+	void copy_if_damaged() {
+		if ( damage_rects.empty() )
+			return;
+
+		damage_rects.merge();
+		std::vector< XRectangle > rects = damage_rects.list();
+
+		int bytes_pp = frame->bits_per_pixel / 8;
+		for ( auto r = rects.begin(); r != rects.end(); ++r ) {
+			XImage sub = sub_image( staging, staging->data, r->width, r->height );
+			if ( player )
+				player->read( *r, &sub );
+			else
+				TM( get_image, XShmGetImage( src->dpy, src_window.win, &sub,
+						src_screen.info.x_org + r->x, src_screen.info.y_org + r->y, AllPlanes ) );
+			stats.bytes_captured += (uint64_t) sub.bytes_per_line * sub.height;
+
+			std::lock_guard< std::mutex > guard( frame_mutex );
+			for ( int y = 0; y < r->height; ++y )
+				memcpy( frame->data + ( r->y + y ) * frame->bytes_per_line + r->x * bytes_pp,
+					sub.data + y * sub.bytes_per_line, r->width * bytes_pp );
+		}
+
+		for ( auto s = sinks.begin(); s != sinks.end(); ++s )
+			(*s)->damaged( damage_rects );
+		++stats.frames;
+
+		damage_rects.clear();
+	}
+};
+
+// Decides when to copy: damage is gathered for a while after it first
+// comes in, and copies are at least interval apart. In low latency mode,
+// damage after a quiet period is copied right away and only the following
+// copies are throttled.
+struct frame_pacer {
+	uint64_t interval;		// minimal time between copies (us)
+	uint64_t window;		// time to gather damage (us)
+	bool low_latency;
+	uint64_t last_copy;		// time of the last copy
+	uint64_t first_damage;	// time of the first damage since, 0 if none
+
+	frame_pacer( uint64_t _interval, uint64_t _window, bool _low_latency )
+		: interval( _interval ), window( _window ), low_latency( _low_latency )
+		, last_copy( 0 ), first_damage( 0 ) {}
+
+	bool pending() const {
+		return first_damage != 0;
+	}
+
+	void damaged( uint64_t now ) {
+		if ( !first_damage )
+			first_damage = now;
+	}
+
+	// time of the next copy, only meaningful if pending()
+	uint64_t due() const {
+		uint64_t t = first_damage + window;
+		if ( low_latency && first_damage >= last_copy + interval )
+			t = first_damage;
+		return std::max( t, last_copy + interval );
+	}
+
+	void copied( uint64_t now ) {
+		last_copy = now;
+		first_damage = 0;
+	}
+};
+
+// A source screen and the destination screen it is cloned to.
+struct screen_pair {
+	xinerama_screen src, dst;
+	const image_transform *transform;	// NULL if copied as is
+
+	screen_pair( const xinerama_screen &_src, const xinerama_screen &_dst, const image_transform *_transform )
+		: src( _src ), dst( _dst ), transform( _transform ) {}
+
+	// Maps a point from the source root window to the destination one.
+	void map_point( int &x, int &y ) const {
+		x -= src.info.x_org;
+		y -= src.info.y_org;
+		if ( transform )
+			transform->map_point( x, y );
+		x += dst.info.x_org;
+		y += dst.info.y_org;
+	}
+};
+
+// Latest pointer position, published by the RECORD callback and taken by
+// whoever warps the destination pointer. Older positions are overwritten,
+// so any number of motion events cost at most one warp. A single atomic
+// word, so it works from any thread without a lock.
+struct pointer_mailbox {
+	std::atomic< uint64_t > slot;	// bit 32 set if there is a position
 
-void window::define_cursor( Cursor c ) {
-	TC( XDefineCursor( d->dpy, win, c ) );
-}
+	pointer_mailbox() : slot( 0 ) {}
 
-bool xinerama_screen::in_screen( int x, int y ) const {
-	return x >= info.x_org && x < info.x_org + info.width
-		&& y >= info.y_org && y < info.y_org + info.height;
-}
+	void publish( int x, int y ) {
+		slot.store( ( 1ull << 32 ) | ( (uint64_t) (uint16_t) y << 16 ) | (uint16_t) x, std::memory_order_release );
+	}
 
-bool segment_intersect( int a1, int a2, int b1, int b2 ) {
-	return a1 < b1 ? a2 > b1 : b2 > a1;
-}
+	bool take( int &x, int &y ) {
+		uint64_t v = slot.exchange( 0, std::memory_order_acquire );
+		if ( !v )
+			return false;
 
-bool xinerama_screen::intersect_rectangle( const XRectangle &rec ) const {
-	return segment_intersect( rec.x, rec.x + rec.width,  info.x_org, info.x_org + info.width  )
-		&& segment_intersect( rec.y, rec.y + rec.height, info.y_org, info.y_org + info.height );
-}
+		x = (int16_t) ( v & 0xffff );
+		y = (int16_t) ( ( v >> 16 ) & 0xffff );
+		return true;
+	}
 
-struct image_replayer {
-	const display *src, *dst;
-	const xinerama_screen *src_screen, *dst_screen;
-	window src_window, dst_window;
-	XShmSegmentInfo src_info, dst_info;
-	XImage *src_image, *dst_image;
-	GC dst_gc;
-	bool damaged;
+	bool full() const {
+		return slot.load( std::memory_order_relaxed ) != 0;
+	}
+};
 
-	image_replayer( const display &_src, const display &_dst, const xinerama_screen &_src_screen, const xinerama_screen &_dst_screen )
-		: src( &_src ), dst( &_dst)
-		, src_screen( &_src_screen ), dst_screen( &_dst_screen )
-		, src_window( src->root() ), dst_window( dst->root() )
-		, damaged( true )
-	{	
-		size_t sz = src_screen->info.width * src_screen->info.height * 4;
-		src_info.shmid = dst_info.shmid = shmget( IPC_PRIVATE, sz, IPC_CREAT | 0666 );
-		src_info.shmaddr = dst_info.shmaddr = (char *) shmat( src_info.shmid, 0, 0);
-		src_info.readOnly = dst_info.readOnly = false;
-		shmctl( src_info.shmid, IPC_RMID, NULL );
+// Destination cursors by XFixes cursor serial, least recently used ones
+// are dropped. Pointing at text fields and links switches between a few
+// cursors all the time, each of them only has to be uploaded once.
+struct cursor_cache {
+	struct entry {
+		unsigned long serial;
+		Cursor cursor;
+		uint64_t used;
+	};
 
-		src_image = XShmCreateImage( src->dpy, DefaultVisual( src->dpy, DefaultScreen( src->dpy ) ),
-			DefaultDepth( src->dpy, DefaultScreen( src->dpy ) ), ZPixmap, src_info.shmaddr,
-			&src_info, src_screen->info.width, src_screen->info.height );
-		dst_image = XShmCreateImage( dst->dpy, DefaultVisual( dst->dpy, DefaultScreen( dst->dpy ) ),
-			DefaultDepth( dst->dpy, DefaultScreen( dst->dpy ) ), ZPixmap, dst_info.shmaddr,
-			&dst_info, src_screen->info.width, src_screen->info.height );
+	static const size_t max_entries = 32;
 
-		XShmAttach( src->dpy, &src_info );
-		XShmAttach( dst->dpy, &dst_info );
+	Display *dpy;
+	std::vector< entry > entries;
+	uint64_t clock;
 
-		dst_gc = DefaultGC( dst->dpy, DefaultScreen( dst->dpy ) );
-	}
+	cursor_cache( Display *_dpy ) : dpy( _dpy ), clock( 0 ) {}
 
-	void copy_if_damaged() {
-		if ( !damaged )
-			return;
+	~cursor_cache() {
+		for ( auto e = entries.begin(); e != entries.end(); ++e )
+			XFreeCursor( dpy, e->cursor );
+	}
 
-		TC( XShmGetImage( src->dpy, src_window.win, src_image,
-				src_screen->info.x_org, src_screen->info.y_org, AllPlanes) );
-		TC( XShmPutImage( dst->dpy, dst_window.win, dst_gc, dst_image, 0, 0,
-				dst_screen->info.x_org, dst_screen->info.y_org,
-				dst_image->width, dst_image->height, False ) );
-		TC( XFlush( dst->dpy ) );
+	Cursor find( unsigned long serial ) {
+		for ( auto e = entries.begin(); e != entries.end(); ++e )
+			if ( e->serial == serial ) {
+				e->used = ++clock;
+				return e->cursor;
+			}
 
-		DBG( std::cout << "damaged" << std::endl );
+		return None;
+	}
 
-		damaged = false;
+	// Forgets the cursors, which went with the connection they were on.
+	void reset( Display *_dpy ) {
+		dpy = _dpy;
+		entries.clear();
 	}
 
-	void damage( const XRectangle &rec ) {
-		damaged = damaged || src_screen->intersect_rectangle( rec );
+	void insert( unsigned long serial, Cursor cursor ) {
+		if ( entries.size() == max_entries ) {
+			auto lru = entries.begin();
+			for ( auto e = entries.begin(); e != entries.end(); ++e )
+				if ( e->used < lru->used )
+					lru = e;
+
+			XFreeCursor( dpy, lru->cursor );
+			entries.erase( lru );
+		}
+
+		entry e = { serial, cursor, ++clock };
+		entries.push_back( e );
 	}
 };
 
 struct mouse_replayer {
-	const display src, dst;
-	const xinerama_screen src_screen, dst_screen;
+	typedef std::vector< screen_pair > pairs_vector;
+
+	const display src;
+	display dst;	// replaced when the destination comes back
+	pairs_vector pairs;	// replaced when the screens change
 	window dst_window;
 	Cursor invisibleCursor;
-	volatile bool on;
+	bool on;
+	size_t active;	// pair the pointer is in, if on
 	bool wiggle;
-	std::recursive_mutex cursor_mutex;
-
-	mouse_replayer( const display &_src, const display &_dst, const xinerama_screen &_src_screen, const xinerama_screen &_dst_screen, bool _wiggle )
-		: src( _src ), dst( _dst), src_screen( _src_screen ), dst_screen( _dst_screen ), dst_window( dst.root() )
-		, on( false ), wiggle( _wiggle )
+	pointer_mailbox motion;
+	uint64_t warp_interval;	// at most one warp per that many us
+	uint64_t last_warp;
+	cursor_cache cursors;
+	unsigned long cursor_serial;	// of the source cursor, 0 if not known yet
+	int last_x, last_y;	// where the pointer was last moved to on the source
+	soft_cursor *soft;	// drawn into the images instead, NULL if not
+	const XFixesCursorImage *replayed;	// the cursor of a recording being played, NULL if not
+
+	mouse_replayer( const display &_src, const display &_dst, const pairs_vector &_pairs, bool _wiggle, uint64_t _warp_interval,
+			soft_cursor *_soft )
+		: src( _src ), dst( _dst), pairs( _pairs ), dst_window( dst.root() )
+		, on( false ), active( 0 ), wiggle( _wiggle )
+		, warp_interval( _warp_interval ), last_warp( 0 )
+		, cursors( dst.dpy ), cursor_serial( 0 ), last_x( 0 ), last_y( 0 ), soft( _soft ), replayed( NULL )
 	{
+		if ( soft ) {
+			// the destination pointer is left alone, start from where the
+			// source pointer is
+			invisibleCursor = None;
+			Window root, child;
+			int x, y, win_x, win_y;
+			unsigned int mask;
+			if ( XQueryPointer( src.dpy, src.root().win, &root, &child, &x, &y, &win_x, &win_y, &mask ) )
+				mouse_moved( x, y );
+			cursor_changed();
+			return;
+		}
+
+		hide_pointer();
+	}
+
+	// The destination was lost and is back as d. Nothing on the old
+	// connection is left, the pointer is set up again with the next move.
+	void reconnect( const display &d ) {
+		dst = d;
+		dst_window = dst.root();
+		cursors.reset( dst.dpy );
+		on = false;
+		if ( !soft )
+			hide_pointer();
+	}
+
+	// Makes the destination pointer invisible until it enters a clone.
+	void hide_pointer() {
 		// create invisible cursor
 		Pixmap bitmapNoData;
 		XColor black;
@@ -306,23 +2986,61 @@ struct mouse_replayer {
 			const xEvent &e = * (const xEvent *) data->data;
 
 			if ( e.u.u.type == MotionNotify ) {
-				mouse_moved( e.u.keyButtonPointer.rootX, e.u.keyButtonPointer.rootY );
+				++stats.motion_events;
+				motion.publish( e.u.keyButtonPointer.rootX, e.u.keyButtonPointer.rootY );
 			}
 		}
 
 		XRecordFreeData( data );
 	}
 
+	// When the next warp may happen, 0 if there's nothing to warp to.
+	uint64_t warp_due() const {
+		if ( !motion.full() )
+			return 0;
+		// 0 would mean no deadline, a warp that's due at once is due now
+		return std::max( last_warp + warp_interval, microtime() );
+	}
+
+	// Warps to the latest position, unless the last warp was too recent.
+	// The first motion after a quiet period goes through right away.
+	void flush_motion( uint64_t now ) {
+		int x, y;
+		if ( now < last_warp + warp_interval || !motion.take( x, y ) )
+			return;
+
+		last_warp = now;
+		mouse_moved( x, y );
+	}
+
 	void mouse_moved( int x, int y ) {
-		std::lock_guard< std::recursive_mutex > guard( cursor_mutex );
+		uint64_t start = microtime();
+		last_x = x;
+		last_y = y;
+
+		if ( soft ) {
+			soft->move( x, y );
+			return;
+		}
 
 		bool old_on = on;
-		on = src_screen.in_screen( x, y );
+		on = false;
+
+		// If an area is cloned more than once, the destination has only
+		// one pointer anyway, so it stays in the first clone instead of
+		// jumping between them.
+		for ( size_t i = 0; i < pairs.size(); ++i )
+			if ( pairs[ i ].src.in_screen( x, y ) ) {
+				on = true;
+				active = i;
+				break;
+			}
 
-		if ( on )
-			dst_window.warp_pointer( x - src_screen.info.x_org + dst_screen.info.x_org,
-				y - src_screen.info.y_org + dst_screen.info.y_org );
-		else if ( wiggle )
+		if ( on ) {
+			int dx = x, dy = y;
+			pairs[ active ].map_point( dx, dy );
+			dst_window.warp_pointer( dx, dy );
+		} else if ( wiggle )
 			// wiggle the cursor a bit to keep screensaver away
 			dst_window.warp_pointer( x % 50, y % 50 );
 
@@ -334,48 +3052,399 @@ struct mouse_replayer {
 		}
 
 		TC( XFlush( dst.dpy ) );
+		++stats.warps;
+		stats.cursor_warp.add( microtime() - start );
 
 		DBG( std::cout << "mouse moved" << std::endl );
 	}
 
-	void cursor_changed() {
-		std::lock_guard< std::recursive_mutex > guard( cursor_mutex );
+	// Called with the serial from XFixesCursorNotify, or 0 when the
+	// pointer enters the clone area and the last known cursor is wanted.
+	void cursor_changed( unsigned long serial = 0 ) {
+		if ( serial )
+			cursor_serial = serial;
+
+		if ( soft ) {
+			++stats.cursor_changes;
+			XFixesCursorImage *cur = source_cursor();
+			if ( !cur )
+				return;
+			cursor_serial = cur->cursor_serial;
+			soft->set_image( cur );
+			release_cursor( cur );
+			return;
+		}
 
 		if ( !on )
 			return;
 
-		XFixesCursorImage *cur;
-		XcursorImage image;
-		Cursor cursor;
-
-		cur = TC( XFixesGetCursorImage( src.dpy ) );
-		memset( &image, 0, sizeof( image ) );
-		image.width  = cur->width;
-		image.height = cur->height;
-		image.size	 = std::max( image.width, image.height );
-		image.xhot	 = cur->xhot;
-		image.yhot	 = cur->yhot;
-
-		if ( 0 && sizeof( * image.pixels ) == sizeof( * cur->pixels ) ) {
-			// 32-bit machines where int is long
-			image.pixels = (unsigned int *) cur->pixels;
-		} else {
+		++stats.cursor_changes;
+		Cursor cursor = cursor_serial ? cursors.find( cursor_serial ) : None;
+
+		if ( cursor == None ) {
+			XFixesCursorImage *cur;
+			XcursorImage image;
+
+			++stats.cursor_uploads;
+			cur = source_cursor();
+			if ( !cur )
+				return;
+			memset( &image, 0, sizeof( image ) );
+			image.width  = cur->width;
+			image.height = cur->height;
+			image.size	 = std::max( image.width, image.height );
+			image.xhot	 = cur->xhot;
+			image.yhot	 = cur->yhot;
 			image.pixels = (unsigned int *) alloca(
 				image.width * image.height * sizeof( unsigned int ) );
-			for ( unsigned i = 0; i < image.width * image.height; ++i )
-				image.pixels[ i ] = cur->pixels[ i ];
-		}
+			narrow_pixels( cur->pixels, image.pixels, image.width * image.height );
 
-		cursor = TC( XcursorImageLoadCursor( dst.dpy, &image ) );
-		XFree( cur );
+			cursor = TC( XcursorImageLoadCursor( dst.dpy, &image ) );
+			// the image is the current one, which may be newer than the notify
+			cursor_serial = cur->cursor_serial;
+			cursors.insert( cursor_serial, cursor );
+			release_cursor( cur );
+		}
 
 		TC( XDefineCursor( dst.dpy, dst_window.win, cursor ) );
-		XFreeCursor( dst.dpy, cursor );
 
 		TC( XFlush( dst.dpy ) );
 
 		DBG( std::cout << "cursor changed" << std::endl );
 	}
+
+	// The current cursor of the source, for release_cursor when done.
+	XFixesCursorImage *source_cursor() {
+		if ( replayed )
+			return const_cast< XFixesCursorImage * >( replayed );
+		return TC( XFixesGetCursorImage( src.dpy ) );
+	}
+
+	void release_cursor( XFixesCursorImage *cur ) {
+		if ( cur != replayed )
+			XFree( cur );
+	}
+};
+
+// Sends one screen to screenclone-receiver over a socket instead of
+// putting it on a destination display, or records it to a file, see
+// stream_protocol.h. Also takes the place of mouse_replayer: pointer
+// positions and cursors go on the same stream.
+struct stream_sender : damage_sink {
+	const display src;
+	const xinerama_screen screen;
+	window src_window;
+	damage_region damage_rects;
+	int fd;
+	bool recording;
+	uint64_t started;
+	std::vector< char > queued;	// messages not written yet
+	shm_block block;
+	XImage *image;
+	std::vector< uint32_t > previous;	// the last frame that was sent
+	std::vector< uint32_t > delta, out;
+	std::set< unsigned long > sent_cursors;
+	pointer_mailbox motion;
+	bool visible;
+	int last_x, last_y;
+
+	// address is where to connect to, or the file to record to
+	stream_sender( const display &_src, const xinerama_screen &_screen, const std::string &address, bool _recording )
+		: src( _src ), screen( _screen ), src_window( src.root() )
+		, damage_rects( screen.info.width, screen.info.height )
+		, recording( _recording ), started( microtime() )
+		, previous( screen.info.width * screen.info.height )
+		, visible( false ), last_x( -1 ), last_y( -1 )
+	{
+		image = shm_arena::create_image( src.dpy, screen.info.width, screen.info.height );
+		if ( image->bits_per_pixel != 32 || image->red_mask != fmt_rgb888::red
+				|| image->green_mask != fmt_rgb888::green || image->blue_mask != fmt_rgb888::blue )
+			ERR2( "streaming needs a 32 bit xRGB source" );
+
+		block = shm_pool.alloc( image->bytes_per_line * image->height );
+		shm_pool.use( image, block, src.dpy );
+
+		if ( recording ) {
+			fd = open( address.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+			if ( fd < 0 )
+				ERR2( "can't create " + address + ": " + strerror( errno ) );
+		} else
+			try {
+				fd = stream_socket( address, false );
+			} catch ( const std::exception &e ) {
+				ERR2( e.what() );
+			}
+
+		stream_hello hello = { stream_magic, stream_version,
+			(uint16_t) screen.info.width, (uint16_t) screen.info.height };
+		send( stream_msg_hello, &hello, sizeof( hello ) );
+		flush_queued();
+
+		// the receiver starts with the pointer where it is and the current
+		// cursor, not only after they change
+		Window root, child;
+		int x, y, win_x, win_y;
+		unsigned int mask;
+		if ( XQueryPointer( src.dpy, src_window.win, &root, &child, &x, &y, &win_x, &win_y, &mask ) ) {
+			motion.publish( x, y );
+			flush_motion();
+		}
+		cursor_changed( 0 );
+	}
+
+	const xinerama_screen &source() const {
+		return screen;
+	}
+
+	// everything is written as soon as it's copied
+	bool idle() {
+		return damage_rects.empty();
+	}
+
+	void damage( const XRectangle &rec, uint64_t when = 0 ) {
+		damage_rects.add( rec, screen, when );
+	}
+
+	void copy_if_damaged() {
+		if ( damage_rects.empty() )
+			return;
+
+		damage_rects.merge();
+		std::vector< XRectangle > rects = damage_rects.list();
+
+		for ( auto r = rects.begin(); r != rects.end(); ++r ) {
+			XImage sub = sub_image( image, image->data, r->width, r->height );
+			TM( get_image, XShmGetImage( src.dpy, src_window.win, &sub,
+					screen.info.x_org + r->x, screen.info.y_org + r->y, AllPlanes ) );
+			stats.bytes_captured += (uint64_t) sub.bytes_per_line * sub.height;
+
+			// XOR with the previous frame, which becomes the new one
+			delta.resize( r->width * r->height );
+			for ( int y = 0; y < r->height; ++y ) {
+				const uint32_t *p = (const uint32_t *) ( sub.data + y * sub.bytes_per_line );
+				uint32_t *prev = &previous[ ( r->y + y ) * screen.info.width + r->x ];
+				uint32_t *d = &delta[ y * r->width ];
+				for ( int x = 0; x < r->width; ++x ) {
+					d[ x ] = p[ x ] ^ prev[ x ];
+					prev[ x ] = p[ x ];
+				}
+			}
+
+			stream_tile tile = { (uint16_t) r->x, (uint16_t) r->y, r->width, r->height };
+			out.assign( (const uint32_t *) &tile, (const uint32_t *) ( &tile + 1 ) );
+			stream_encode( &delta[ 0 ], delta.size(), out );
+			send( stream_msg_tile, &out[ 0 ], out.size() * sizeof( uint32_t ) );
+		}
+
+		send( stream_msg_frame_end, NULL, 0 );
+		flush_queued();
+		++stats.frames;
+		if ( damage_rects.since )
+			stats.damage_to_present.add( microtime() - damage_rects.since );
+		damage_rects.clear();
+	}
+
+	void send( uint32_t type, const void *data, size_t length ) {
+		stream_header header = { type, (uint32_t) length };
+		queued.insert( queued.end(), (const char *) &header, (const char *) ( &header + 1 ) );
+		queued.insert( queued.end(), (const char *) data, (const char *) data + length );
+	}
+
+	// Writes what was sent since the last time, as one chunk if recording.
+	void flush_queued() {
+		if ( queued.empty() )
+			return;
+
+		if ( recording ) {
+			if ( queued.size() % 8 )
+				queued.resize( queued.size() + 4 );
+			stream_chunk chunk = { stream_chunk_magic, (uint32_t) queued.size(), microtime() - started };
+			write_all( &chunk, sizeof( chunk ) );
+		}
+		write_all( &queued[ 0 ], queued.size() );
+		stats.bytes_uploaded += queued.size();
+		queued.clear();
+	}
+
+	void write_all( const void *data, size_t length ) {
+		const char *p = (const char *) data;
+		while ( length ) {
+			ssize_t n = recording ? write( fd, p, length ) : ::send( fd, p, length, MSG_NOSIGNAL );
+			if ( n < 0 && errno == EINTR )
+				continue;
+			if ( n <= 0 )
+				ERR2( std::string( "can't write the stream: " ) + strerror( errno ) );
+			p += n;
+			length -= n;
+		}
+	}
+
+	// RECORD callback, like mouse_replayer's
+	void operator() ( XRecordInterceptData *data ) {
+		if ( data->category == XRecordFromServer ) {
+			const xEvent &e = * (const xEvent *) data->data;
+
+			if ( e.u.u.type == MotionNotify ) {
+				++stats.motion_events;
+				motion.publish( e.u.keyButtonPointer.rootX, e.u.keyButtonPointer.rootY );
+			}
+		}
+
+		XRecordFreeData( data );
+	}
+
+	void flush_motion() {
+		int x, y;
+		if ( !motion.take( x, y ) )
+			return;
+
+		bool was_visible = visible;
+		visible = screen.in_screen( x, y );
+		x -= screen.info.x_org;
+		y -= screen.info.y_org;
+		if ( visible == was_visible && ( !visible || ( x == last_x && y == last_y ) ) )
+			return;
+
+		last_x = x;
+		last_y = y;
+		stream_pointer pointer = { (int16_t) x, (int16_t) y, visible, 0 };
+		send( stream_msg_pointer, &pointer, sizeof( pointer ) );
+		flush_queued();
+		++stats.warps;
+	}
+
+	void cursor_changed( unsigned long serial ) {
+		++stats.cursor_changes;
+		if ( sent_cursors.count( serial ) ) {
+			stream_cursor cursor = { (uint32_t) serial, 0, 0, 0, 0 };
+			send( stream_msg_cursor, &cursor, sizeof( cursor ) );
+			flush_queued();
+			return;
+		}
+
+		++stats.cursor_uploads;
+		XFixesCursorImage *cur = TC( XFixesGetCursorImage( src.dpy ) );
+		if ( !cur )
+			return;
+		stream_cursor cursor = { (uint32_t) cur->cursor_serial, cur->width, cur->height, cur->xhot, cur->yhot };
+		out.assign( (const uint32_t *) &cursor, (const uint32_t *) ( &cursor + 1 ) );
+		out.resize( out.size() + cur->width * cur->height );
+		narrow_pixels( cur->pixels, &out[ out.size() - cur->width * cur->height ], cur->width * cur->height );
+		sent_cursors.insert( cur->cursor_serial );
+		XFree( cur );
+
+		send( stream_msg_cursor, &out[ 0 ], out.size() * sizeof( uint32_t ) );
+		flush_queued();
+	}
+};
+
+// What main does for all kinds of clones: gathers the damage of the
+// source, hands it to the sinks that cover it, and has them copy when the
+// pacer says so. Events of the source that aren't damage go to
+// other_event; the caller adds its other connections to events.
+struct clone_loop {
+	display *src;	// NULL if the damage comes from elsewhere
+	std::unique_ptr< window > damage_source;	// the root window, or a cloned window
+	bool accumulate;
+	frame_pacer pacer;
+	reactor events;
+	std::vector< damage_sink * > sinks;
+	int damage_x, damage_y;	// where damage is relative to
+	std::function< void( XEvent & ) > other_event;
+
+	// With accumulated damage, the time of the first notify since the
+	// last fetch; the rectangles only come with the fetch.
+	uint64_t first_notify;
+	std::vector< XRectangle > fetched;
+
+	clone_loop( display *_src, Window damage_window, bool _accumulate, const frame_pacer &_pacer )
+		: src( _src ), accumulate( _accumulate ), pacer( _pacer ), damage_x( 0 ), damage_y( 0 ), first_notify( 0 )
+	{
+		if ( !src )
+			return;
+
+		damage_source.reset( new window( *src, damage_window ) );
+		damage_source->create_damage( accumulate );
+
+		events.add_display( *src, [this]{
+			while ( src->pending() ) {
+				XEvent e = src->next_event();
+				if ( e.type == src->damage_event + XDamageNotify ) {
+					const XDamageNotifyEvent &de = * (const XDamageNotifyEvent *) &e;
+					++stats.damage_events;
+					if ( accumulate ) {
+						// the rectangles come with the next fetch
+						if ( !first_notify )
+							first_notify = microtime();
+						pacer.damaged( microtime() );
+					} else
+						source_damaged( de.area, 0 );
+				} else if ( other_event )
+					other_event( e );
+			}
+		} );
+	}
+
+	// rect is in source root window coordinates, when is 0 for now
+	void damaged( const XRectangle &rect, uint64_t when ) {
+		for ( auto s = sinks.begin(); s != sinks.end(); ++s )
+			if ( (*s)->source().intersect_rectangle( rect ) ) {
+				(*s)->damage( rect, when );
+				pacer.damaged( microtime() );
+			}
+	}
+
+	// rect is relative to damage_source
+	void source_damaged( XRectangle rect, uint64_t when ) {
+		rect.x += damage_x;
+		rect.y += damage_y;
+		damaged( rect, when );
+	}
+
+	bool behind() const {
+		for ( auto s = sinks.begin(); s != sinks.end(); ++s )
+			if ( (*s)->behind() )
+				return true;
+		return false;
+	}
+
+	// Whether all damage so far is on the destinations.
+	bool idle() {
+		if ( pacer.pending() )
+			return false;
+		for ( auto s = sinks.begin(); s != sinks.end(); ++s )
+			if ( !(*s)->idle() )
+				return false;
+		return true;
+	}
+
+	// Copies if it's time, or the rest of a big update right away, then
+	// handles events until the next copy or deadline (0 for none). x, y is
+	// the pointer in root window coordinates.
+	void run_once( int x, int y, uint64_t deadline ) {
+		bool due = pacer.pending() && pacer.due() <= microtime();
+		if ( due || behind() ) {
+			if ( damage_source && accumulate ) {
+				damage_source->fetch_damage( fetched );
+				for ( auto r = fetched.begin(); r != fetched.end(); ++r )
+					source_damaged( *r, first_notify );
+				first_notify = 0;
+			} else if ( damage_source )
+				damage_source->clear_damage();
+			for ( auto s = sinks.begin(); s != sinks.end(); ++s ) {
+				(*s)->focus( x, y );
+				(*s)->copy_if_damaged();
+			}
+
+			if ( due )
+				pacer.copied( microtime() );
+		}
+
+		uint64_t next = behind() ? microtime() : pacer.pending() ? pacer.due() : 0;
+		if ( deadline && ( !next || deadline < next ) )
+			next = deadline;
+		events.run_once( next );
+	}
 };
 
 void usage( const char *name )
@@ -387,7 +3456,32 @@ void usage( const char *name )
 		<< " -d <target display name> (default :1)" << std::endl
 		<< " -x <xinerama screen number on source> (default 0)" << std::endl
 		<< " -D <xinerama screen number on target> (default 0)" << std::endl
-		<< " -w do not wiggle the mouse (screensaver might come on, but necessary for multi-clones)" << std::endl;
+		<< "    -x and -D can be repeated to clone several screens, e.g. -x 0 -D 1 -x 2 -D 0" << std::endl
+		<< "    a source screen given with several -D is captured once for all of them; that only" << std::endl
+		<< "    works for the screens of the one -d target, other targets need their own screenclone" << std::endl
+		<< " -w do not wiggle the mouse (screensaver might come on)" << std::endl
+		<< " -t upload only tiles that really changed (costs a copy of the screen in memory)" << std::endl
+		<< " -f <max copies per second, or 'auto' for the target refresh rate> (default unlimited)" << std::endl
+		<< " -c <milliseconds to gather damage before copying> (default 0)" << std::endl
+		<< " -l low latency: copy damage after a quiet period right away, throttle only after that" << std::endl
+		<< " -p <number of buffers> capture and upload in separate threads, overlapping frames (2 or 3 is good)" << std::endl
+		<< " -S <fit|fill> scale to the size of the target screen, keeping the aspect ratio" << std::endl
+		<< " -R <0|90|180|270> rotate clockwise (e.g. for a portrait target)" << std::endl
+		<< " -M mirror left to right" << std::endl
+		<< " -m <file> write statistics to the file every second" << std::endl
+		<< " -r <max pointer warps per second, 0 for every motion> (default: refresh rate of the target)" << std::endl
+		<< " -a accumulate damage in the server and fetch it once per copy, instead of an event per rectangle" << std::endl
+		<< " -n <host:port or socket path> send the first screen to screenclone-receiver instead of a target display" << std::endl
+		<< " -o <file> record the first screen to a file instead, for screenclone-receiver -r" << std::endl
+		<< " -q <uploads> at most that many frames in flight to the target, newer ones wait for them (default 2)" << std::endl
+		<< " -B <MiB> at most that much shared memory for images (default 1024, 0 for no limit)" << std::endl
+		<< " -k <ms> copy big updates in chunks of about that long, nearest to the pointer first (default 0, all at once)" << std::endl
+		<< " -C draw the cursor into the cloned image instead of moving the target pointer" << std::endl
+		<< " -P always upload with XShmPutImage, even if the target has shared pixmaps" << std::endl
+		<< " -W <window id> clone that window instead of a source screen, even when it's covered (needs Composite)" << std::endl
+		<< " -i <file> play a recording of -o as the source, as fast as possible, and print how long it took" << std::endl
+		<< "    (no source display; the recorded screen is source screen 0, -x is ignored)" << std::endl
+		<< " -T play the recording of -i at the recorded pace" << std::endl;
 	exit( 0 );
 }
 
@@ -603,6 +3697,39 @@ xinerama_screen& get_xinerama_screen_nvidia(display& disp, int screen, display::
 
 #endif
 
+// Refresh rate of the CRTC showing the given screen, 0 if unknown.
+double refresh_rate(display& disp, const xinerama_screen& screen)
+{
+	Window root = RootWindow (disp.dpy, DefaultScreen (disp.dpy));
+	XRRScreenResources* res = XRRGetScreenResources(disp.dpy, root);
+	if (!res)
+		return 0;
+
+	double rate = 0;
+	for (int c = 0; c < res->ncrtc && rate == 0; c++) {
+		XRRCrtcInfo* crtc_info = XRRGetCrtcInfo(disp.dpy, res, res->crtcs[c]);
+		if (!crtc_info)
+			continue;
+
+		if (             crtc_info->mode   != None
+			&&           screen.info.x_org  == crtc_info->x
+			&&           screen.info.y_org  == crtc_info->y
+			&& (unsigned)screen.info.width  == crtc_info->width
+			&& (unsigned)screen.info.height == crtc_info->height ) {
+			for (int m = 0; m < res->nmode; m++) {
+				const XRRModeInfo& mode = res->modes[m];
+				if (mode.id == crtc_info->mode && mode.hTotal && mode.vTotal)
+					rate = (double) mode.dotClock / ((double) mode.hTotal * mode.vTotal);
+			}
+		}
+
+		XRRFreeCrtcInfo(crtc_info);
+	}
+
+	XRRFreeScreenResources(res);
+	return rate;
+}
+
 xinerama_screen& get_xinerama_screen(display& disp, display::screens_vector& screens, char* name)
 {
 	if ( !name )
@@ -713,17 +3840,117 @@ xinerama_screen& get_xinerama_screen(display& disp, display::screens_vector& scr
 	return *result;
 }
 
+// A window as if it was a screen: where it is on the root window and how
+// big it is, without the border. It has to be mapped.
+xinerama_screen window_screen( const display &disp, Window win, int &border )
+{
+	XWindowAttributes attr;
+	if ( !XGetWindowAttributes( disp.dpy, win, &attr ) )
+		ERR2( "no such window" );
+	if ( attr.map_state != IsViewable )
+		ERR2( "the window isn't mapped" );
+	if ( attr.depth != DefaultDepth( disp.dpy, DefaultScreen( disp.dpy ) ) )
+		ERR2( "the window has a depth of its own" );
+
+	int x, y;
+	Window child;
+	XTranslateCoordinates( disp.dpy, win, DefaultRootWindow( disp.dpy ), 0, 0, &x, &y, &child );
+	border = attr.border_width;
+
+	XineramaScreenInfo info;
+	memset( &info, 0, sizeof( info ) );
+	info.screen_number = -1;
+	info.x_org = x;
+	info.y_org = y;
+	info.width = attr.width;
+	info.height = attr.height;
+	return xinerama_screen( disp, info );
+}
+
+bool same_geometry( const xinerama_screen &a, const xinerama_screen &b ) {
+	return a.info.x_org == b.info.x_org && a.info.y_org == b.info.y_org
+		&& a.info.width == b.info.width && a.info.height == b.info.height;
+}
+
+// Set in main, to tell the destination's connections from the source's.
+std::string dst_display_name;
+
+// Xlib can't go on with a broken connection. When the destination server
+// goes away (e.g. the NVIDIA server is restarted), this only sets dst_lost
+// and returns; io_error_exit keeps Xlib from exiting, and main connects
+// again. Losing the source is fatal as before.
+int io_error( Display *d ) {
+	if ( dst_display_name != DisplayString( d ) ) {
+		std::cerr << "lost connection to " << DisplayString( d ) << std::endl;
+		exit( 1 );
+	}
+
+	dst_lost = true;
+	return 0;
+}
+
+// Names of a source and destination screen given by -x and -D.
+struct clone_spec {
+	char *src_screen_name, *dst_screen_name;
+};
+
+// Runs the stream_sender for one screen of the source, like main does
+// for the image_replayers.
+void stream_main( display &src, stream_sender &sender, const frame_pacer &pacer, bool accumulate, const std::string &stats_file ) {
+	window root = src.root();
+	clone_loop clone( &src, root.win, accumulate, pacer );
+	clone.sinks.push_back( &sender );
+	clone.other_event = [&]( XEvent &e ) {
+		if ( e.type == src.xfixes_event + XFixesCursorNotify )
+			sender.cursor_changed( ( (const XFixesCursorNotifyEvent *) &e )->cursor_serial );
+	};
+
+	display record = src.record_pointer_events( &sender );
+	src.select_cursor_input( root );
+	clone.events.add_display( record, [&]{
+		XRecordProcessReplies( record.dpy );
+	} );
+
+	if ( !stats_file.empty() )
+		std::thread( &stats_thread, stats_file ).detach();
+
+	clone.pacer.damaged( microtime() );
+
+	for ( ;; ) {
+		sender.flush_motion();
+		// the pointer only matters to image_replayers
+		clone.run_once( 0, 0, 0 );
+	}
+}
+
 int main( int argc, char *argv[] )
 {
 	XInitThreads();
 
 	std::string src_name( ":0" ), dst_name( ":1" );
-	char *src_screen_name = NULL,
-	     *dst_screen_name = NULL;
+	std::vector< clone_spec > clones;
 	bool wiggle = true;
+	bool use_tile_diff = false;
+	const char *max_fps = NULL;
+	uint64_t coalesce = 0;
+	bool low_latency = false;
+	int ring = 0;
+	image_transform::options transform_opt = { image_transform::scale_none, 0, false };
+	std::string stats_file;
+	const char *warp_rate = NULL;
+	bool accumulate = false;
+	std::string stream_address;
+	bool recording = false;
+	int uploads = 2;
+	uint64_t chunk_budget = 0;
+	bool draw_cursor = false;
+	bool use_pixmap = true;
+	Window clone_window = None;
+	std::string replay_file;
+	bool replay_timed = false;
 
 	int opt;
-	while ( ( opt = getopt( argc, argv, "s:d:x:D:hw" ) ) != -1 )
+	while ( ( opt = getopt( argc, argv, "s:d:x:D:hwtf:c:lp:S:R:Mm:r:an:o:q:B:k:CPW:i:T" ) ) != -1 )
 		switch ( opt ) {
 		case 's':
 			src_name = optarg;
@@ -732,50 +3959,438 @@ int main( int argc, char *argv[] )
 			dst_name = optarg;
 			break;
 		case 'x':
-			src_screen_name = optarg;
+			// fill in the last pair, or start a new one
+			if ( clones.empty() || clones.back().src_screen_name ) {
+				clone_spec c = { NULL, NULL };
+				clones.push_back( c );
+			}
+			clones.back().src_screen_name = optarg;
 			break;
 		case 'D':
-			dst_screen_name = optarg;
+			if ( clones.empty() || clones.back().dst_screen_name ) {
+				clone_spec c = { NULL, NULL };
+				clones.push_back( c );
+			}
+			clones.back().dst_screen_name = optarg;
 			break;
 		case 'w':
 			wiggle = false;
 			break;
+		case 't':
+			use_tile_diff = true;
+			break;
+		case 'f':
+			max_fps = optarg;
+			break;
+		case 'c':
+			coalesce = atoi( optarg ) * 1000;
+			break;
+		case 'l':
+			low_latency = true;
+			break;
+		case 'p':
+			ring = atoi( optarg );
+			break;
+		case 'S':
+			if ( strcmp( optarg, "fit" ) == 0 )
+				transform_opt.scale = image_transform::scale_fit;
+			else if ( strcmp( optarg, "fill" ) == 0 )
+				transform_opt.scale = image_transform::scale_fill;
+			else
+				usage( argv[ 0 ] );
+			break;
+		case 'R':
+			transform_opt.rotation = atoi( optarg );
+			break;
+		case 'M':
+			transform_opt.mirror = true;
+			break;
+		case 'm':
+			stats_file = optarg;
+			break;
+		case 'r':
+			warp_rate = optarg;
+			break;
+		case 'a':
+			accumulate = true;
+			break;
+		case 'n':
+			stream_address = optarg;
+			break;
+		case 'o':
+			stream_address = optarg;
+			recording = true;
+			break;
+		case 'q':
+			uploads = atoi( optarg );
+			break;
+		case 'B':
+			shm_pool.limit = (size_t) atoi( optarg ) << 20;
+			break;
+		case 'k':
+			chunk_budget = atof( optarg ) * 1000;
+			break;
+		case 'C':
+			draw_cursor = true;
+			break;
+		case 'P':
+			use_pixmap = false;
+			break;
+		case 'W':
+			clone_window = strtoul( optarg, NULL, 0 );
+			break;
+		case 'i':
+			replay_file = optarg;
+			break;
+		case 'T':
+			replay_timed = true;
+			break;
 		default:
 			usage( argv[ 0 ] );
 		}
 
-	if ( src_name == dst_name )
+	if ( clones.empty() ) {
+		clone_spec c = { NULL, NULL };
+		clones.push_back( c );
+	}
+
+	if ( !stream_address.empty() ) {
+		display src( src_name );
+		auto src_screens = src.xinerama_screens();
+		stream_sender sender( src, get_xinerama_screen( src, src_screens, clones[ 0 ].src_screen_name ),
+			stream_address, recording );
+
+		// there's no target to ask for its refresh rate
+		double fps = max_fps ? atof( max_fps ) : 0;
+		frame_pacer pacer( fps > 0 ? 1000000 / fps : 0, coalesce, low_latency );
+		stream_main( src, sender, pacer, accumulate, stats_file );
+		return 0;
+	}
+
+	// A recording is played with a second connection to the target in the
+	// place of the source, for the images to capture into. Losing the
+	// target ends the replay.
+	std::unique_ptr< recording_player > player;
+	if ( !replay_file.empty() ) {
+		if ( !stream_address.empty() || clone_window )
+			usage( argv[ 0 ] );
+		player.reset( new recording_player( replay_file, replay_timed ) );
+		src_name = dst_name;
+	} else if ( src_name == dst_name )
 		ERR;
 	display src( src_name ), dst( dst_name );
 
-	auto src_screens = src.xinerama_screens();
-	auto dst_screens = dst.xinerama_screens();
+	if ( !player )
+		dst_display_name = DisplayString( dst.dpy );
+	XSetIOErrorHandler( &io_error );
+
+	// A cloned window is redirected, so its content is kept in a pixmap
+	// even where it's covered, and captured from there.
+	Pixmap window_pixmap = None;
+	int window_border = 0;
+	int window_width = 0, window_height = 0;	// of the cloned window, without the border
+	if ( clone_window ) {
+		int event_base, error_base, major = 0, minor = 2;
+		if ( !XCompositeQueryExtension( src.dpy, &event_base, &error_base )
+				|| !XCompositeQueryVersion( src.dpy, &major, &minor ) || ( major == 0 && minor < 2 ) )
+			ERR2( "no Composite 0.2 on the source" );
+		XCompositeRedirectWindow( src.dpy, clone_window, CompositeRedirectAutomatic );
+		XSelectInput( src.dpy, clone_window, StructureNotifyMask );
+	}
+
+	// damage of a cloned window is relative to it; the copy rate is known
+	// once the target screens are
+	window root = src.root();
+	clone_loop clone( player ? NULL : &src, clone_window ? clone_window : root.win, accumulate,
+		frame_pacer( 0, coalesce, low_latency ) );
+
+	mouse_replayer::pairs_vector pairs;
+	soft_cursor cursor;
+	std::vector< std::unique_ptr< image_replayer > > images;
+	std::vector< std::unique_ptr< fanout_replayer > > fanouts;
+
+	// Resolves the screens by name and sets up a clone for each. Clones of
+	// the same source screen share one capture if they can. Called again
+	// when the screens change: clones whose screens are still the same are
+	// kept with their buffers, the others are made anew.
+	auto setup = [&]{
+		auto src_screens = src.xinerama_screens();
+		auto dst_screens = dst.xinerama_screens();
+
+		std::vector< xinerama_screen > srcs, dsts;
+		for ( auto c = clones.begin(); c != clones.end(); ++c ) {
+			srcs.push_back( player ? player->screen( src )
+				: clone_window ? window_screen( src, clone_window, window_border )
+				: get_xinerama_screen(src, src_screens, c->src_screen_name) );
+			dsts.push_back( get_xinerama_screen(dst, dst_screens, c->dst_screen_name) );
+		}
 
-	auto &src_screen = get_xinerama_screen(src, src_screens, src_screen_name);
-	auto &dst_screen = get_xinerama_screen(dst, dst_screens, dst_screen_name);
+		std::vector< std::unique_ptr< image_replayer > > old;
+		clone.sinks.clear();
+		old.swap( images );
+		fanouts.clear();
+		pairs.clear();
+
+		if ( clone_window ) {
+			// nothing may capture from the old pixmap any more
+			old.clear();
+			if ( window_pixmap )
+				XFreePixmap( src.dpy, window_pixmap );
+			window_pixmap = XCompositeNameWindowPixmap( src.dpy, clone_window );
+			clone.damage_x = srcs[ 0 ].info.x_org;
+			clone.damage_y = srcs[ 0 ].info.y_org;
+			window_width = srcs[ 0 ].info.width;
+			window_height = srcs[ 0 ].info.height;
+		}
 
-	// Clone src not to fight with the blocking loop.
-	mouse_replayer mouse( src.clone(), dst, src_screen, dst_screen, wiggle );
-	image_replayer image( src, dst, src_screen, dst_screen );
+		// index of the fanout_replayer for each clone, -1 for none
+		std::vector< int > fanout( clones.size(), -1 );
+		// fanouts don't draw the cursor and capture from the root window
+		if ( !transform_opt.enabled() && !draw_cursor && !clone_window && fanout_replayer::supported( src, dst ) )
+			for ( size_t c = 0; c < clones.size(); ++c ) {
+				std::vector< xinerama_screen > targets;
+				for ( size_t o = c; o < clones.size(); ++o )
+					if ( fanout[ o ] < 0 && same_geometry( srcs[ o ], srcs[ c ] ) )
+						targets.push_back( dsts[ o ] );
+				if ( fanout[ c ] >= 0 || targets.size() < 2 )
+					continue;
 
-	window root = src.root();
-	root.create_damage();
+				for ( size_t o = c; o < clones.size(); ++o )
+					if ( fanout[ o ] < 0 && same_geometry( srcs[ o ], srcs[ c ] ) )
+						fanout[ o ] = fanouts.size();
+				fanouts.push_back( std::unique_ptr< fanout_replayer >(
+					new fanout_replayer( src, dst, srcs[ c ], targets, use_tile_diff, player.get() ) ) );
+			}
 
-	src.record_pointer_events( &mouse );
-	src.select_cursor_input( root );
+		for ( size_t c = 0; c < clones.size(); ++c ) {
+			if ( fanout[ c ] >= 0 ) {
+				pairs.push_back( screen_pair( srcs[ c ], dsts[ c ], NULL ) );
+				continue;
+			}
+
+			auto reuse = old.begin();
+			while ( reuse != old.end() && !( *reuse && same_geometry( (*reuse)->src_screen, srcs[ c ] )
+					&& same_geometry( (*reuse)->dst_screen, dsts[ c ] ) ) )
+				++reuse;
+
+			if ( reuse != old.end() )
+				images.push_back( std::move( *reuse ) );
+			else
+				images.push_back( std::unique_ptr< image_replayer >(
+					new image_replayer( src, dst, srcs[ c ], dsts[ c ], use_tile_diff, ring, uploads, chunk_budget,
+						draw_cursor ? &cursor : NULL, use_pixmap, transform_opt, player.get() ) ) );
+			if ( clone_window )
+				images.back()->capture_from( window_pixmap, window_border, window_border );
+			pairs.push_back( screen_pair( srcs[ c ], dsts[ c ], images.back()->transform.get() ) );
+		}
+
+		for ( auto i = images.begin(); i != images.end(); ++i )
+			clone.sinks.push_back( i->get() );
+		for ( auto f = fanouts.begin(); f != fanouts.end(); ++f )
+			clone.sinks.push_back( f->get() );
+	};
+	setup();
+
+	double fps = 0;
+	if ( max_fps && strcmp( max_fps, "auto" ) == 0 ) {
+		for ( auto p = pairs.begin(); p != pairs.end(); ++p )
+			fps = std::max( fps, refresh_rate( dst, p->dst ) );
+		if ( fps == 0 )
+			std::cerr << "WARN: couldn't determine the refresh rate, not limiting copies" << std::endl;
+	} else if ( max_fps )
+		fps = atof( max_fps );
+
+	clone.pacer.interval = fps > 0 ? 1000000 / fps : 0;
+
+	double warps = 0;
+	if ( warp_rate )
+		warps = atof( warp_rate );
+	else {
+		for ( auto p = pairs.begin(); p != pairs.end(); ++p )
+			warps = std::max( warps, refresh_rate( dst, p->dst ) );
+		if ( warps == 0 )
+			warps = 60;
+	}
+
+	// Everything below runs in this thread, so the connections are shared.
+	mouse_replayer mouse( src, dst, pairs, wiggle, warps > 0 ? 1000000 / warps : 0, draw_cursor ? &cursor : NULL );
+
+	// pointer and cursor come from the recording when playing one
+	std::unique_ptr< display > record;
+	if ( !player ) {
+		record.reset( new display( src.record_pointer_events( &mouse ) ) );
+		src.select_cursor_input( root );
+		src.select_screen_changes();
+	}
+	dst.select_screen_changes();
+	// repainted from the frame pixmaps, if there are any
+	XSelectInput( dst.dpy, dst.root().win, ExposureMask );
+	bool reconfigure = false;
+
+	if ( !stats_file.empty() )
+		std::thread( &stats_thread, stats_file ).detach();
+
+	// A move or restack of the cloned window: the pixmap stays, only where
+	// the window is on the root window changes.
+	auto window_moved = [&]{
+		int x, y;
+		Window child;
+		XTranslateCoordinates( src.dpy, clone_window, DefaultRootWindow( src.dpy ), 0, 0, &x, &y, &child );
+		if ( x == clone.damage_x && y == clone.damage_y )
+			return;
+
+		clone.damage_x = x;
+		clone.damage_y = y;
+		for ( auto i = images.begin(); i != images.end(); ++i )
+			(*i)->moved( x, y );
+		for ( auto p = pairs.begin(); p != pairs.end(); ++p ) {
+			p->src.info.x_org = x;
+			p->src.info.y_org = y;
+		}
+		mouse.pairs = pairs;
+	};
+
+	clone.other_event = [&]( XEvent &e ) {
+		if ( e.type == src.xfixes_event + XFixesCursorNotify ) {
+			mouse.cursor_changed( ( (const XFixesCursorNotifyEvent *) &e )->cursor_serial );
+		} else if ( clone_window && e.type == DestroyNotify && e.xdestroywindow.window == clone_window ) {
+			ERR2( "the cloned window is gone" );
+		} else if ( clone_window && e.type == ConfigureNotify && e.xconfigure.window == clone_window ) {
+			const XConfigureEvent &ce = e.xconfigure;
+			if ( ce.width != window_width || ce.height != window_height || ce.border_width != window_border )
+				// resized, the pixmap is a new one then
+				reconfigure = true;
+			else if ( !reconfigure )
+				window_moved();
+		} else if ( clone_window && ( e.type == MapNotify || e.type == UnmapNotify ) && e.xany.window == clone_window ) {
+			reconfigure = true;
+		} else if ( src.screen_changed( e ) )
+			reconfigure = true;
+	};
+
+	if ( record )
+		clone.events.add_display( *record, [&]{
+			XRecordProcessReplies( record->dpy );
+		} );
+
+	// screen changes and upload completions come from the destination,
+	// read whatever else comes too so it doesn't pile up
+	int shm_event = XShmGetEventBase( dst.dpy );
+	auto dst_events = [&]{
+		while ( dst.pending() ) {
+			XEvent e = dst.next_event();
+			if ( dst.screen_changed( e ) )
+				reconfigure = true;
+			else if ( e.type == Expose ) {
+				for ( auto i = images.begin(); i != images.end(); ++i )
+					(*i)->exposed( e.xexpose );
+			} else if ( e.type == shm_event + ShmCompletion )
+				for ( auto i = images.begin(); i != images.end(); ++i )
+					if ( (*i)->completed( (const XShmCompletionEvent &) e ) ) {
+						// damage held back while it was in flight
+						if ( !(*i)->damage_rects.empty() )
+							clone.pacer.damaged( microtime() );
+						break;
+					}
+		}
+	};
+	clone.events.add_display( dst, dst_events );
+
+	// The destination is gone with everything on it: the clones, their
+	// connections and the cursors. The source side and the shared memory
+	// stay; once the destination is back, setup() starts over.
+	auto reconnect = [&]{
+		std::cerr << "lost connection to " << dst_display_name << ", waiting for it to come back" << std::endl;
+		clone.events.remove( ConnectionNumber( dst.dpy ) );
+		clone.sinks.clear();
+		images.clear();
+		fanouts.clear();
+		pairs.clear();
+		mouse.pairs = pairs;
+		shm_pool.detach( dst.dpy );
+		XCloseDisplay( dst.dpy );
+
+		for ( useconds_t backoff = 10000; ; backoff = std::min( backoff * 2, (useconds_t) 1000000 ) ) {
+			usleep( backoff );
+			try {
+				dst = display( dst_name );
+				break;
+			} catch ( const std::exception & ) {
+			}
+		}
+		dst_lost = false;
+		std::cerr << "connected to " << dst_display_name << " again" << std::endl;
+
+		dst.select_screen_changes();
+		XSelectInput( dst.dpy, dst.root().win, ExposureMask );
+		shm_event = XShmGetEventBase( dst.dpy );
+		clone.events.add_display( dst, dst_events );
+		mouse.reconnect( dst );
+		reconfigure = true;
+	};
+
+	// the first copy is of the whole screen
+	clone.pacer.damaged( microtime() );
 
 	for ( ;; ) {
-		do {
-			const XEvent e = src.next_event();
-			if ( e.type == src.damage_event + XDamageNotify ) {
-				const XDamageNotifyEvent &de = * (const XDamageNotifyEvent *) &e;
-				image.damage( de.area );
-			} else if ( e.type == src.xfixes_event + XFixesCursorNotify ) {
-				mouse.cursor_changed();
-			}
-		} while ( src.pending() );
-
-		root.clear_damage();
-		image.copy_if_damaged();
+		if ( reconfigure ) {
+			// a burst of events is drained before this, so it's done once
+			reconfigure = false;
+			try {
+				setup();
+			} catch ( const std::exception &e ) {
+				// e.g. the output was unplugged, wait for the next change
+				std::cerr << "WARN: " << e.what() << ", not cloning until the screens change again" << std::endl;
+				images.clear();
+				fanouts.clear();
+				pairs.clear();
+			}
+			mouse.pairs = pairs;
+			for ( auto i = images.begin(); i != images.end(); ++i )
+				(*i)->damage_rects.full = true;
+			for ( auto f = fanouts.begin(); f != fanouts.end(); ++f )
+				(*f)->damage_rects.full = true;
+			clone.pacer.damaged( microtime() );
+		}
+
+		mouse.flush_motion( microtime() );
+
+		// redraw where the cursor was and where it is now
+		XRectangle before, after;
+		if ( draw_cursor && cursor.changed( before, after ) ) {
+			clone.damaged( before, 0 );
+			clone.damaged( after, 0 );
+		}
+
+		uint64_t deadline = mouse.warp_due();
+		if ( player ) {
+			if ( !player->done() && player->due() <= microtime() )
+				player->play( [&]( const XRectangle &rect ) {
+					clone.damaged( rect, 0 );
+				}, [&]( int x, int y ) {
+					mouse.motion.publish( x, y );
+				}, [&]( const XFixesCursorImage *image ) {
+					mouse.replayed = image;
+					mouse.cursor_changed( image->cursor_serial );
+				} );
+
+			if ( player->done() && clone.idle() ) {
+				double seconds = ( microtime() - player->started ) / 1e6;
+				printf( "{\"recording\": \"%s\", \"frames\": %llu, \"copies\": %llu, \"seconds\": %.3f, \"fps\": %.1f}\n",
+					replay_file.c_str(), (unsigned long long) player->frames,
+					(unsigned long long) stats.frames, seconds, player->frames / seconds );
+				return 0;
+			}
+
+			// the pipeline threads don't wake this one up when they're done
+			uint64_t next = player->done() ? microtime() + 1000 : player->due();
+			if ( !deadline || next < deadline )
+				deadline = next;
+		}
+
+		clone.run_once( mouse.last_x, mouse.last_y, deadline );
+
+		if ( dst_lost )
+			reconnect();
 	}
 }
@@ -0,0 +1,194 @@
+// Frame stream between screenclone -n and screenclone-receiver.
+//
+// Every message is a stream_header followed by length bytes of payload.
+// Both ends are expected to run on the same architecture, values are in
+// host byte order. Pixels are 32 bit xRGB.
+//
+// A tile is the XOR of the new pixels of a rectangle with the previous
+// ones, run-length encoded in 32 bit words: a word with the top bit set
+// skips that many unchanged pixels, any other word n is followed by n
+// changed (XORed) pixels. Repainted but unchanged areas cost next to
+// nothing, so the bandwidth follows the change and not the resolution.
+
+#ifndef STREAM_PROTOCOL_H
+#define STREAM_PROTOCOL_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+enum {
+	stream_magic = 0x4e4c4353,	// "SCLN"
+	stream_version = 1,
+};
+
+enum {
+	stream_msg_hello,		// stream_hello
+	stream_msg_tile,		// stream_tile, then the encoded tile
+	stream_msg_frame_end,	// nothing, the receiver flushes
+	stream_msg_pointer,		// stream_pointer
+	stream_msg_cursor,		// stream_cursor, then the pixels unless sent before
+};
+
+struct stream_header {
+	uint32_t type, length;
+};
+
+struct stream_hello {
+	uint32_t magic, version;
+	uint16_t width, height;
+};
+
+struct stream_tile {
+	uint16_t x, y, width, height;
+};
+
+struct stream_pointer {
+	int16_t x, y;		// relative to the cloned screen
+	uint16_t visible;	// whether the pointer is in the cloned screen
+	uint16_t unused;	// messages are whole 32 bit words
+};
+
+// Cursors are identified by serial, the pixels (ARGB) are only sent the
+// first time.
+struct stream_cursor {
+	uint32_t serial;
+	uint16_t width, height, xhot, yhot;
+};
+
+// A recording (screenclone -o) holds the same messages in a file, in
+// chunks of what was sent at once: a stream_chunk, then length bytes of
+// messages. A chunk may end with 4 bytes of padding to keep the next one
+// 8 byte aligned, so the file can be mapped and walked in place.
+struct stream_chunk {
+	uint32_t magic, length;
+	uint64_t time;	// us since the start of the recording
+};
+
+enum {
+	stream_chunk_magic = 0x434c4353,	// "SCLC"
+};
+
+enum {
+	stream_skip = 0x80000000,
+};
+
+// Appends the encoding of delta (n XORed pixels) to out.
+inline void stream_encode( const uint32_t *delta, size_t n, std::vector< uint32_t > &out ) {
+	size_t i = 0;
+	while ( i < n ) {
+		size_t j = i;
+		if ( !delta[ i ] ) {
+			while ( j < n && !delta[ j ] && j - i < stream_skip - 1 )
+				++j;
+			out.push_back( stream_skip | ( j - i ) );
+		} else {
+			while ( j < n && delta[ j ] && j - i < stream_skip - 1 )
+				++j;
+			out.push_back( j - i );
+			out.insert( out.end(), delta + i, delta + j );
+		}
+		i = j;
+	}
+}
+
+// Applies an encoded tile of width x height pixels to the image at dst,
+// whose rows are stride bytes apart. Returns false if the data is broken.
+inline bool stream_decode( const uint32_t *in, size_t words, char *dst, size_t stride, int width, int height ) {
+	size_t n = (size_t) width * height, p = 0;
+	const uint32_t *end = in + words;
+	while ( in < end ) {
+		uint32_t token = *in++;
+		if ( token & stream_skip ) {
+			p += token & ~stream_skip;
+			if ( p > n )
+				return false;
+			continue;
+		}
+
+		if ( token > (size_t) ( end - in ) || p + token > n )
+			return false;
+		for ( ; token; --token, ++p )
+			( (uint32_t *) ( dst + p / width * stride ) )[ p % width ] ^= *in++;
+	}
+	return true;
+}
+
+// Addresses are host:port for TCP, anything with a slash is a Unix socket.
+inline int stream_socket( const std::string &address, bool listening ) {
+	int fd;
+	if ( address.find( '/' ) != std::string::npos ) {
+		struct sockaddr_un addr;
+		memset( &addr, 0, sizeof( addr ) );
+		addr.sun_family = AF_UNIX;
+		if ( address.size() >= sizeof( addr.sun_path ) )
+			throw std::runtime_error( "socket path too long: " + address );
+		strcpy( addr.sun_path, address.c_str() );
+
+		fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+		if ( fd < 0 )
+			throw std::runtime_error( "socket: " + std::string( strerror( errno ) ) );
+		bool failed;
+		if ( listening ) {
+			unlink( addr.sun_path );
+			failed = bind( fd, (struct sockaddr *) &addr, sizeof( addr ) ) || listen( fd, 1 );
+		} else
+			failed = connect( fd, (struct sockaddr *) &addr, sizeof( addr ) );
+		if ( failed ) {
+			std::string error = strerror( errno );
+			close( fd );
+			throw std::runtime_error( "can't " + std::string( listening ? "listen on " : "connect to " ) + address + ": " + error );
+		}
+		return fd;
+	}
+
+	size_t colon = address.rfind( ':' );
+	if ( colon == std::string::npos )
+		throw std::runtime_error( "expected host:port or a socket path: " + address );
+	std::string host = address.substr( 0, colon ), port = address.substr( colon + 1 );
+
+	struct addrinfo hints, *res;
+	memset( &hints, 0, sizeof( hints ) );
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = listening ? AI_PASSIVE : 0;
+	if ( getaddrinfo( host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &res ) )
+		throw std::runtime_error( "can't resolve " + address );
+
+	fd = socket( res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol );
+	if ( fd < 0 ) {
+		freeaddrinfo( res );
+		throw std::runtime_error( "socket: " + std::string( strerror( errno ) ) );
+	}
+
+	int one = 1;
+	bool failed;
+	if ( listening ) {
+		setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+		failed = bind( fd, res->ai_addr, res->ai_addrlen ) || listen( fd, 1 );
+	} else {
+		failed = connect( fd, res->ai_addr, res->ai_addrlen );
+		// tiles are written whole, don't wait for more
+		setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+	}
+	std::string error = strerror( errno );
+	freeaddrinfo( res );
+	if ( failed ) {
+		close( fd );
+		throw std::runtime_error( "can't " + std::string( listening ? "listen on " : "connect to " ) + address + ": " + error );
+	}
+
+	return fd;
+}
+
+#endif	// STREAM_PROTOCOL_H